@@ -0,0 +1,230 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/**
+ * Runtime parameters and machine-readable results shared by the programs.
+ *
+ * Every parameter can be set on the command line as name=value, e.g.
+ *   ./well num_people=100 max_occupancy=5
+ * and json=1 adds one line of JSON with the run's results at the end of the
+ * output; bench/run.sh collects those lines.
+ *
+ * Results are throughput, latency percentiles of whatever the program calls an
+ * operation, OS context switches and wake-ups per operation.  A wake-up is a
+ * waiter that a signal, broadcast or semaphore signal actually released;
+ * signals that find nobody waiting do not count.
+ */
+
+struct Param {
+	const char* name;
+	int*        value;
+	int         min;    // smallest value bench_init accepts
+};
+
+struct Param*  bench_params;
+int            bench_json;
+long long      bench_start_ns;
+long long      bench_elapsed_ns;
+long           bench_context_switches;
+long           bench_wakeups;
+long long*     bench_latencies;
+long           bench_num_latencies;
+long           bench_max_latencies;
+long long*     bench_interval_latencies;  // metrics.h's, NULL unless it publishes
+long           bench_interval_num;        // since metrics.h last took them
+long           bench_interval_max;
+
+long long bench_now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// including child processes that have been waited for
+static long bench_context_switch_count() {
+	struct rusage u, c;
+	getrusage(RUSAGE_SELF, &u);
+	getrusage(RUSAGE_CHILDREN, &c);
+	return u.ru_nvcsw + u.ru_nivcsw + c.ru_nvcsw + c.ru_nivcsw;
+}
+
+// The process's virtual and resident memory in bytes, from /proc/self/statm
+// (Linux); 0 where that cannot be read.
+void bench_memory(long* virtual_bytes, long* resident_bytes) {
+	long v = 0, r = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%ld %ld", &v, &r) != 2)
+			v = r = 0;
+		fclose(f);
+	}
+	*virtual_bytes = v * sysconf(_SC_PAGESIZE);
+	*resident_bytes = r * sysconf(_SC_PAGESIZE);
+}
+
+// Set params (terminated by a NULL name) from name=value arguments, and exit
+// if one is below its min.
+void bench_init(int argc, char** argv, struct Param* params) {
+	bench_params = params;
+	for (int i = 1; i < argc; i++) {
+		char* eq = strchr(argv[i], '=');
+		int found = 0;
+		if (eq) {
+			if (strncmp(argv[i], "json", eq - argv[i]) == 0 && eq - argv[i] == 4) {
+				bench_json = atoi(eq + 1);
+				continue;
+			}
+			for (struct Param* p = params; p->name; p++)
+				if (strlen(p->name) == eq - argv[i] && strncmp(argv[i], p->name, eq - argv[i]) == 0) {
+					*p->value = atoi(eq + 1);
+					found = 1;
+				}
+		}
+		if (!found) {
+			fprintf(stderr, "usage: %s [json=1]", argv[0]);
+			for (struct Param* p = params; p->name; p++)
+				fprintf(stderr, " [%s=%d]", p->name, *p->value);
+			fprintf(stderr, "\n");
+			exit(1);
+		}
+	}
+	for (struct Param* p = params; p->name; p++)
+		if (*p->value < p->min) {
+			fprintf(stderr, "%s: %s must be at least %d\n", argv[0], p->name, p->min);
+			exit(1);
+		}
+}
+
+// Start timing; room for up to max_latencies latency samples, past which they
+// are a uniform sample of all of them (see bench_sample_slot).
+void bench_start(long max_latencies) {
+	bench_max_latencies = max_latencies;
+	bench_latencies = malloc(max_latencies * sizeof(long long));
+	bench_num_latencies = 0;
+	bench_wakeups = 0;
+	bench_context_switches = bench_context_switch_count();
+	bench_start_ns = bench_now();
+}
+
+// Where the i-th of a stream of samples goes in an array of size n, or -1 to
+// drop it.  Past n, each goes in with probability n / (i + 1) in place of a
+// random one (reservoir sampling), so the array stays a uniform sample however
+// long the stream gets.  Thread safe.
+long bench_sample_slot(long i, long n) {
+	static __thread unsigned long long x = 88172645463325252ULL;
+	if (i < n)
+		return i;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	long j = x % (i + 1);
+	return j < n ? j : -1;
+}
+
+// Thread safe.  While metrics.h publishes, also sampled separately for its
+// current interval, as the run's samples stop changing once they are full.
+void bench_latency(long long ns) {
+	long i = __atomic_fetch_add(&bench_num_latencies, 1, __ATOMIC_RELAXED);
+	long j = bench_sample_slot(i, bench_max_latencies);
+	if (j >= 0)
+		bench_latencies[j] = ns;
+	long long* interval = __atomic_load_n(&bench_interval_latencies, __ATOMIC_ACQUIRE);
+	if (interval) {
+		i = __atomic_fetch_add(&bench_interval_num, 1, __ATOMIC_RELAXED);
+		j = bench_sample_slot(i, bench_interval_max);
+		if (j >= 0)
+			interval[j] = ns;
+	}
+}
+
+// n waiters were released.  Thread safe.
+void bench_wakeup(long n) {
+	__atomic_fetch_add(&bench_wakeups, n, __ATOMIC_RELAXED);
+}
+
+static int bench_compare(const void* a, const void* b) {
+	long long x = *(const long long*) a, y = *(const long long*) b;
+	return x < y ? -1 : x > y;
+}
+
+static long long bench_percentile(long n, double q) {
+	long i = (long) (q * n);
+	return n == 0 ? 0 : bench_latencies[i < n ? i : n - 1];
+}
+
+// Waits for admission, in entries that went by and in ns.  Past max of them
+// they are a uniform sample of all of them (see bench_sample_slot).
+struct BenchWaits {
+	long       n;        // atomic
+	long       max;
+	int*       entries;
+	long long* ns;
+};
+
+void bench_waits_init(struct BenchWaits* w, long max) {
+	w->n = 0;
+	w->max = max;
+	w->entries = malloc(max * sizeof(int));
+	w->ns = malloc(max * sizeof(long long));
+}
+
+// Thread safe.
+void bench_wait(struct BenchWaits* w, int entries, long long ns) {
+	long i = __atomic_fetch_add(&w->n, 1, __ATOMIC_RELAXED);
+	long j = bench_sample_slot(i, w->max);
+	if (j >= 0) {
+		w->entries[j] = entries;
+		w->ns[j] = ns;
+	}
+}
+
+static int bench_compare_int(const void* a, const void* b) {
+	return *(const int*) a - *(const int*) b;
+}
+
+// Print name's wait percentiles, if it had any.  Sorts the samples.
+void bench_print_waits(const char* name, struct BenchWaits* w) {
+	long n = w->n < w->max ? w->n : w->max;
+	if (n == 0)
+		return;
+	qsort(w->entries, n, sizeof(int), bench_compare_int);
+	qsort(w->ns, n, sizeof(long long), bench_compare);
+	printf("%s: %ld entries (%ld sampled); waited for p50 %d p90 %d p99 %d max %d entries, p50 %.1f p90 %.1f p99 %.1f max %.1f us\n",
+		name, w->n, n, w->entries[n / 2], w->entries[(long) (0.9 * n)], w->entries[(long) (0.99 * n)], w->entries[n - 1],
+		w->ns[n / 2] / 1e3, w->ns[(long) (0.9 * n)] / 1e3, w->ns[(long) (0.99 * n)] / 1e3, w->ns[n - 1] / 1e3);
+}
+
+void bench_stop() {
+	bench_elapsed_ns = bench_now() - bench_start_ns;
+	bench_context_switches = bench_context_switch_count() - bench_context_switches;
+}
+
+// With json=1, print the results of ops operations between bench_start and bench_stop.
+void bench_report(const char* program, long ops) {
+	const char* slash = strrchr(program, '/');
+	if (slash)
+		program = slash + 1;
+	double seconds = bench_elapsed_ns / 1e9;
+	long switches = bench_context_switches;
+	long n = bench_num_latencies < bench_max_latencies ? bench_num_latencies : bench_max_latencies;
+	if (!bench_json)
+		return;
+	qsort(bench_latencies, n, sizeof(long long), bench_compare);
+	printf("{\"program\":\"%s\",\"params\":{", program);
+	for (struct Param* p = bench_params; p->name; p++)
+		printf("%s\"%s\":%d", p == bench_params ? "" : ",", p->name, *p->value);
+	printf("},\"ops\":%ld,\"seconds\":%.6f,\"throughput\":%.1f", ops, seconds, ops / seconds);
+	printf(",\"latency_ns\":{\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld}",
+		bench_percentile(n, 0.5), bench_percentile(n, 0.9), bench_percentile(n, 0.99), bench_percentile(n, 1));
+	printf(",\"context_switches_per_op\":%.4f,\"wakeups_per_op\":%.4f}\n",
+		(double) switches / ops, (double) bench_wakeups / ops);
+}
+
+#endif
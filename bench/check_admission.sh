@@ -0,0 +1,65 @@
+#!/bin/sh
+# Checks that well, well_sem and well-fc with one priority (the default) admit
+# drinkers in the same order as the version before priorities were added.
+#
+#   bench/check_admission.sh [uthread_dir]
+#
+# Builds both versions with -DTRACE against the uthread library (default
+# ../uthread, as in the Makefile), runs them with the same seed on one
+# processor and compares their traces: who entered, waited, woke and left,
+# in what order and with what endianness, ignoring the times.  Needs the git
+# history, and a uthread library whose one processor schedules the same way
+# every run.
+
+UTHREAD=${1:-../uthread}
+CC=${CC:-gcc}
+
+cd "$(dirname "$0")/.." || exit 1
+case $UTHREAD in /*) ;; *) UTHREAD=$(pwd)/$UTHREAD ;; esac
+before=$(git log --format=%H --grep='^\[user-037\] Add' | tail -n 1)
+if [ -z "$before" ]; then
+	echo "$0: cannot find the commit that added priorities" >&2
+	exit 1
+fi
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+mkdir "$tmp/before"
+git archive "$before^" | tar -x -C "$tmp/before" || exit 1
+# it seeded from the time only
+sed 's/srand(time(NULL))/srand(1)/' "$tmp/before/well.c" > "$tmp/before/well1.c"
+sed 's/srand(time(NULL))/srand(1)/' "$tmp/before/well_sem.c" > "$tmp/before/well_sem1.c"
+
+uthread_srcs="$UTHREAD/uthread.c $UTHREAD/uthread_mutex_cond.c $UTHREAD/uthread_sem.c"
+$CC -std=gnu11 -O2 -o "$tmp/trace2json" trace2json.c || exit 1
+
+# events: trace.bin -> its events in order, without their times
+events() {
+	"$tmp/trace2json" "$1" | grep '"ph":' | sed 's/"ts":[0-9.]*,//'
+}
+
+status=0
+for prog in well well_sem well-fc; do
+	src=${prog%-fc}
+	flags=-DTRACE
+	[ "$prog" = "$src" ] || flags="$flags -DFLAT_COMBINING"
+	$CC -std=gnu11 -O2 $flags -I"$UTHREAD" -o "$tmp/$prog-before" "$tmp/before/${src}1.c" $uthread_srcs -lpthread -lm || exit 1
+	$CC -std=gnu11 -O2 $flags -I"$UTHREAD" -o "$tmp/$prog-now" $src.c $uthread_srcs -lpthread -lm || exit 1
+	# small enough for the trace ring, crowded enough that some drinkers
+	# wait past the starvation bound
+	for args in "num_people=20 num_iterations=20" "num_people=50 num_iterations=10" "num_people=100 num_iterations=5"; do
+		TRACE_FILE="$tmp/before.bin" "$tmp/$prog-before" $args > /dev/null 2>&1 || exit 1
+		TRACE_FILE="$tmp/now.bin" "$tmp/$prog-now" $args seed=1 > /dev/null 2>&1 || exit 1
+		events "$tmp/before.bin" > "$tmp/before.txt"
+		events "$tmp/now.bin" > "$tmp/now.txt"
+		if ! grep -q '"in well","ph":"B"' "$tmp/now.txt"; then
+			echo "$prog $args: no entries traced" >&2
+			status=1
+		elif cmp -s "$tmp/before.txt" "$tmp/now.txt"; then
+			echo "$prog $args: same order, $(grep -c '"in well","ph":"B"' "$tmp/now.txt") entries" >&2
+		else
+			echo "$prog $args: order differs from before priorities" >&2
+			status=1
+		fi
+	done
+done
+exit $status
@@ -0,0 +1,111 @@
+#!/bin/sh
+# Benchmark harness.  Runs each program WARMUP times without recording and then
+# REPEATS times recording the JSON line it prints with json=1 (see bench.h).
+#
+#   bench/run.sh [-w warmup] [-r repeats] [-o file] [program [name=value ...]]
+#
+# Without a program, runs the suite below.  Each line of the output file is one
+# run: the program's JSON results with "run" (the repeat number) added.
+
+WARMUP=2
+REPEATS=5
+OUT=/dev/stdout
+
+while getopts "w:r:o:" opt; do
+	case $opt in
+	w) WARMUP=$OPTARG ;;
+	r) REPEATS=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	*) echo "usage: $0 [-w warmup] [-r repeats] [-o file] [program [name=value ...]]" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+cd "$(dirname "$0")/.." || exit 1
+
+# run_one program [name=value ...]
+run_one() {
+	prog=$1
+	shift
+	if [ ! -x "./$prog" ]; then
+		echo "$prog: not built (make $prog)" >&2
+		return 1
+	fi
+	i=0
+	while [ $i -lt "$WARMUP" ]; do
+		"./$prog" "$@" > /dev/null || return 1
+		i=$((i + 1))
+	done
+	i=0
+	while [ $i -lt "$REPEATS" ]; do
+		line=$("./$prog" "$@" json=1 | tail -n 1)
+		case $line in
+		"{"*) echo "$line" | sed "s/^{/{\"run\":$i,/" >> "$OUT" ;;
+		*)    echo "$prog${*:+ $*}: no results" >&2; return 1 ;;
+		esac
+		i=$((i + 1))
+	done
+	echo "$prog${*:+ $*}: done" >&2
+}
+
+if [ $# -gt 0 ]; then
+	run_one "$@"
+	exit $?
+fi
+
+[ "$OUT" = /dev/stdout ] || : > "$OUT"
+status=0
+run_one pc_sem                                      || status=1
+run_one pc_sem num_producers=8 num_consumers=8      || status=1
+run_one pc_sem max_items=1                          || status=1
+# producer tail latency with a slow consumer, for each full-buffer policy
+for p in 0 1 2; do
+	run_one pc_sem policy=$p num_producers=4 num_consumers=1 consumer_delay=50 num_iterations=2000 || status=1
+done
+run_one pc_sem policy=1 max_wait_us=200 num_producers=4 num_consumers=1 consumer_delay=50 num_iterations=2000 || status=1
+# consumers that do not block on an empty buffer
+for c in 1 2; do
+	run_one pc_sem consumer_policy=$c max_wait_us=200 num_producers=2 num_consumers=4 || status=1
+done
+# two processes, shared memory against a pipe
+for size in 64 4096; do
+	for p in 0 1; do
+		run_one pc_shm pipe=$p message_size=$size num_messages=200000 || status=1
+	done
+done
+run_one well                                        || status=1
+run_one well_sem                                    || status=1
+run_one well num_people=50 num_iterations=40        || status=1
+run_one well_sem num_people=50 num_iterations=40    || status=1
+# mixed load: a third of the drinkers at each of 3 priorities
+run_one well num_people=30 num_priorities=3         || status=1
+run_one well_sem num_people=30 num_priorities=3     || status=1
+# replay (see well.c) of 50 bursts of 30 arrivals, 20 ms apart
+trace=$(mktemp)
+awk 'BEGIN { srand(1); for (b = 0; b < 50; b++) for (i = 0; i < 30; i++)
+	printf "%d %s %d %d\n", b * 20000 + int(rand() * 500), rand() < 0.5 ? "big" : "little", 100 + int(rand() * 200), int(rand() * 3) }' > "$trace"
+for m in 3 6; do
+	(export REPLAY_FILE="$trace"; run_one well num_people=16 num_priorities=3 max_occupancy=$m) || status=1
+done
+rm -f "$trace"
+for p in 1 2 4 8; do
+	run_one well    num_people=100 num_iterations=20 num_processors=$p || status=1
+	run_one well-fc num_people=100 num_iterations=20 num_processors=$p || status=1
+done
+run_one smoke                                       || status=1
+for a in 1 4 16; do
+	for s in 1 4; do
+		run_one smoke num_agents=$a num_smokers=$s num_iterations=500 || status=1
+	done
+done
+for f in 0 1; do
+	run_one sem_bench fast=$f                                                    || status=1
+	run_one sem_bench fast=$f num_threads=8 num_processors=4 num_iterations=100000 || status=1
+done
+for c in 0 1; do
+	for q in 0 1; do
+		run_one poll_bench poll=$q cond=$c || status=1
+	done
+	run_one poll_bench poll=1 cond=$c num_pollers=2 num_processors=6 || status=1
+done
+exit $status
@@ -0,0 +1,190 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stdlib.h>
+#include "uthread.h"
+#include "uthread_mutex_cond.h"
+
+/**
+ * Stackless coroutines.
+ *
+ * A coroutine is a small struct holding its own loop counters and a resume
+ * point (state).  Its step procedure runs until it has to yield or block and
+ * then returns, so no coroutine ever needs a stack of its own.  Coroutines are
+ * driven by one event loop per processor; each loop runs as a single uthread.
+ *
+ * A coroutine always runs on the loop that owns it, so a loop never has to
+ * worry about another loop stepping the same coroutine.  Waking a coroutine
+ * from anywhere just puts it back on its owner's ready queue.
+ *
+ * Embed struct Coro as the first member of the coroutine's own struct.
+ */
+
+enum CoroStatus { CORO_YIELD, CORO_BLOCKED, CORO_DONE };
+
+struct Coro {
+	int          state;  // resume point, 0 on first run
+	int          loop;   // index of the loop that owns this coroutine
+	struct Coro* next;   // link for ready queues and wait queues
+};
+
+struct CoroQueue {
+	struct Coro* head;
+	struct Coro* tail;
+};
+
+struct CoroLoop {
+	uthread_mutex_t  mx;
+	uthread_cond_t   not_empty;
+	struct CoroQueue ready;
+	int              live;  // owned coroutines that are not done; only touched by the loop itself
+	enum CoroStatus  (*step)(struct Coro*);
+};
+
+struct CoroLoop* coro_loops;
+int              coro_num_loops;
+
+static void coro_enqueue(struct CoroQueue* q, struct Coro* c) {
+	c->next = NULL;
+	if (q->tail)
+		q->tail->next = c;
+	else
+		q->head = c;
+	q->tail = c;
+}
+
+static struct Coro* coro_dequeue(struct CoroQueue* q) {
+	struct Coro* c = q->head;
+	if (c) {
+		q->head = c->next;
+		if (q->head == NULL)
+			q->tail = NULL;
+	}
+	return c;
+}
+
+// append all of src to dst, leaving src empty
+static void coro_splice(struct CoroQueue* dst, struct CoroQueue* src) {
+	if (src->head == NULL)
+		return;
+	if (dst->tail)
+		dst->tail->next = src->head;
+	else
+		dst->head = src->head;
+	dst->tail = src->tail;
+	src->head = src->tail = NULL;
+}
+
+void coro_init(int num_loops, enum CoroStatus (*step)(struct Coro*)) {
+	coro_num_loops = num_loops;
+	coro_loops = calloc(num_loops, sizeof(struct CoroLoop));
+	for (int i = 0; i < num_loops; i++) {
+		coro_loops[i].mx = uthread_mutex_create();
+		coro_loops[i].not_empty = uthread_cond_create(coro_loops[i].mx);
+		coro_loops[i].step = step;
+	}
+}
+
+// make c runnable on its owning loop
+void coro_ready(struct Coro* c) {
+	struct CoroLoop* l = &coro_loops[c->loop];
+	uthread_mutex_lock(l->mx);
+	coro_enqueue(&l->ready, c);
+	uthread_cond_signal(l->not_empty);
+	uthread_mutex_unlock(l->mx);
+}
+
+// add a new coroutine; must be called before the loops are started
+void coro_spawn(struct Coro* c, int loop) {
+	c->state = 0;
+	c->loop = loop;
+	coro_enqueue(&coro_loops[loop].ready, c);
+	coro_loops[loop].live++;
+}
+
+// Event loop.  Takes the whole ready queue at once so that the loop mutex is
+// acquired once per batch rather than once per step.
+void* coro_loop_run(void* av) {
+	struct CoroLoop* l = av;
+	struct CoroQueue batch, again = { NULL, NULL };
+	while (l->live > 0) {
+		uthread_mutex_lock(l->mx);
+		coro_splice(&l->ready, &again);
+		while (l->ready.head == NULL)
+			uthread_cond_wait(l->not_empty);
+		batch = l->ready;
+		l->ready.head = l->ready.tail = NULL;
+		uthread_mutex_unlock(l->mx);
+
+		struct Coro* c;
+		while ((c = coro_dequeue(&batch)) != NULL) {
+			switch (l->step(c)) {
+			case CORO_YIELD:
+				coro_enqueue(&again, c);
+				break;
+			case CORO_BLOCKED:
+				// c is parked on some wait queue and will be coro_ready'd later
+				break;
+			case CORO_DONE:
+				l->live--;
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Counting semaphore for coroutines.  A signal with waiters hands the unit
+ * straight to the first waiter, so a woken coroutine already owns it.
+ */
+struct CoroSem {
+	uthread_mutex_t  mx;
+	int              value;
+	struct CoroQueue waiters;
+};
+
+struct CoroSem* coro_sem_create(int initial_value) {
+	struct CoroSem* s = malloc(sizeof(struct CoroSem));
+	s->mx = uthread_mutex_create();
+	s->value = initial_value;
+	s->waiters.head = s->waiters.tail = NULL;
+	return s;
+}
+
+// Returns 1 if the unit was taken.  Returns 0 if c was parked instead, in which
+// case the caller must have already set c->state to its resume point and must
+// return CORO_BLOCKED without touching c again.
+int coro_sem_wait(struct CoroSem* s, struct Coro* c) {
+	int acquired;
+	uthread_mutex_lock(s->mx);
+	acquired = s->value > 0;
+	if (acquired)
+		s->value--;
+	else
+		coro_enqueue(&s->waiters, c);
+	uthread_mutex_unlock(s->mx);
+	return acquired;
+}
+
+void coro_sem_signal(struct CoroSem* s) {
+	uthread_mutex_lock(s->mx);
+	struct Coro* c = coro_dequeue(&s->waiters);
+	if (c == NULL)
+		s->value++;
+	uthread_mutex_unlock(s->mx);
+	if (c)
+		coro_ready(c);
+}
+
+// start one loop per processor and wait until every coroutine is done
+void coro_run() {
+	uthread_t* loops = malloc(coro_num_loops * sizeof(uthread_t));
+	for (int i = 0; i < coro_num_loops; i++)
+		loops[i] = uthread_create(coro_loop_run, &coro_loops[i]);
+	for (int i = 0; i < coro_num_loops; i++)
+		uthread_join(loops[i], NULL);
+	free(loops);
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef FAST_SEM_H
+#define FAST_SEM_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "uthread.h"
+#include "uthread_sem.h"
+
+/**
+ * Semaphore with an atomic fast path in front of a uthread_sem.
+ *
+ * count is the semaphore's value minus the number of threads waiting for it.
+ * A wait that finds it positive and a signal that finds nobody waiting are a
+ * single atomic add; only a wait that has to block and a signal that has to
+ * release a blocked thread go through the uthread_sem, which then holds
+ * exactly those hand-offs and starts at 0.
+ *
+ * Signals that find the semaphore free do not hand it to a waiter, so a
+ * running thread can get in ahead of one that is about to be woken.
+ *
+ * A semaphore made with fast_sem_create_pollable can also be waited for with
+ * poll/epoll, alongside file descriptors, on fast_sem_fd:
+ *
+ *   while (!fast_sem_trywait(s)) {
+ *     if (fast_sem_arm(s))
+ *       break;                  // got it after all
+ *     epoll_wait(...);          // fast_sem_fd(s) is one of the fds
+ *     fast_sem_drain(s);        // whichever fd woke it
+ *   }
+ *
+ * The fd is only written when a signal leaves the semaphore free while
+ * someone is armed, so signals cost nothing extra while nobody polls.  Any
+ * number of threads can poll the same semaphore: armed counts them, and a
+ * poller that drains the fd while the semaphore is still free writes it again
+ * for the others, which may have been woken by the same write too late to see
+ * it.
+ */
+
+struct fast_sem {
+	int           count;
+	int           armed;  // threads between fast_sem_arm and fast_sem_drain
+	int           efd;    // -1 unless pollable
+	uthread_sem_t waiters;
+} __attribute__((aligned(64)));
+
+typedef struct fast_sem* fast_sem_t;
+
+fast_sem_t fast_sem_create(int initial_value) {
+	fast_sem_t s = aligned_alloc(64, sizeof(struct fast_sem));
+	s->count = initial_value;
+	s->armed = 0;
+	s->efd = -1;
+	s->waiters = uthread_sem_create(0);
+	return s;
+}
+
+fast_sem_t fast_sem_create_pollable(int initial_value) {
+	fast_sem_t s = fast_sem_create(initial_value);
+	s->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return s;
+}
+
+void fast_sem_destroy(fast_sem_t s) {
+	if (s->efd >= 0)
+		close(s->efd);
+	uthread_sem_destroy(s->waiters);
+	free(s);
+}
+
+void fast_sem_wait(fast_sem_t s) {
+	if (__atomic_fetch_sub(&s->count, 1, __ATOMIC_ACQUIRE) <= 0)
+		uthread_sem_wait(s->waiters);
+}
+
+// Returns 1 if it released a blocked waiter, else 0.
+int fast_sem_signal(fast_sem_t s) {
+	if (__atomic_fetch_add(&s->count, 1, __ATOMIC_SEQ_CST) < 0) {
+		uthread_sem_signal(s->waiters);
+		return 1;
+	}
+	if (__atomic_load_n(&s->armed, __ATOMIC_SEQ_CST) > 0) {
+		uint64_t one = 1;
+		(void) !write(s->efd, &one, sizeof(one));
+	}
+	return 0;
+}
+
+// Returns 1 and decrements the semaphore if that does not have to wait, else returns 0.
+int fast_sem_trywait(fast_sem_t s) {
+	int c = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+	while (c > 0)
+		if (__atomic_compare_exchange_n(&s->count, &c, c - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
+
+// Pollable only.  Readable after a signal that may have freed the semaphore for an armed poller.
+int fast_sem_fd(fast_sem_t s) {
+	return s->efd;
+}
+
+// Pollable only.  Call before polling fast_sem_fd; returns 1 if it decremented
+// the semaphore after all, and then there is no need to poll.  Otherwise the
+// caller is armed until it calls fast_sem_drain.
+int fast_sem_arm(fast_sem_t s) {
+	__atomic_fetch_add(&s->armed, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);  // against fast_sem_signal: it sees armed or this sees its count
+	if (fast_sem_trywait(s)) {
+		__atomic_fetch_sub(&s->armed, 1, __ATOMIC_SEQ_CST);
+		return 1;
+	}
+	return 0;
+}
+
+// Pollable only.  After every poll that followed a fast_sem_arm that returned
+// 0, whether or not fast_sem_fd was readable; then try fast_sem_trywait again.
+void fast_sem_drain(fast_sem_t s) {
+	uint64_t n;
+	(void) !read(s->efd, &n, sizeof(n));
+	// against fast_sem_signal again: it sees this poller armed or this sees its count
+	if (__atomic_sub_fetch(&s->armed, 1, __ATOMIC_SEQ_CST) > 0 && __atomic_load_n(&s->count, __ATOMIC_SEQ_CST) > 0) {
+		uint64_t one = 1;
+		(void) !write(s->efd, &one, sizeof(one));
+	}
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+/**
+ * Lock contention profiler.
+ *
+ * Build with -DLOCK_PROFILE (and -rdynamic, so call sites get names) to record,
+ * for every profiled lock and every call site that acquires it, how often it
+ * was acquired, how often it was already held at the time, and log2 histograms
+ * of the time spent waiting for it and holding it.  Condition variable waits
+ * get a histogram of their own: they wait for a signal and then for the lock,
+ * and the two cannot be told apart.  A report is printed at exit.  Without
+ * LOCK_PROFILE the macros below are just the lock calls.
+ *
+ * The profiled lock's own wrappers must be marked LOCKPROF_WRAPPER so that the
+ * call site they record is their caller.  All statistics of a lock are only
+ * updated while that lock is held, so the profiler needs no locking of its own.
+ */
+
+#ifdef LOCK_PROFILE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <execinfo.h>
+
+#define LOCKPROF_BUCKETS   40  // bucket i counts times in [2^(i-1), 2^i) ns
+#define LOCKPROF_MAX_SITES 16
+
+struct LockProfSite {
+	void*     site;
+	long      acquisitions;  // of the lock itself
+	long      contended;
+	long      cond_waits;    // the lock got back after a condition variable wait
+	long long wait_ns;
+	long long cond_ns;
+	long long hold_ns;
+	long      wait_hist[LOCKPROF_BUCKETS];
+	long      cond_hist[LOCKPROF_BUCKETS];
+	long      hold_hist[LOCKPROF_BUCKETS];  // after either
+};
+
+struct LockProf {
+	const char*          name;
+	volatile int         held;
+	long long            since;   // when the current holder got it
+	struct LockProfSite* holder;  // where the current holder got it
+	int                  num_sites;
+	struct LockProfSite  sites[LOCKPROF_MAX_SITES + 1];  // the last one collects overflow
+	struct LockProf*     next;
+};
+
+struct LockProf* lockprof_all;
+
+static long long lockprof_ns() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int lockprof_bucket(long long ns) {
+	int b = 0;
+	while (ns > 0 && b < LOCKPROF_BUCKETS - 1) {
+		ns >>= 1;
+		b++;
+	}
+	return b;
+}
+
+// upper bound, in ns, of the bucket that holds fraction q of the samples
+static long long lockprof_percentile(long* hist, long n, double q) {
+	long seen = 0;
+	for (int b = 0; b < LOCKPROF_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > 0 && seen >= q * n)
+			return 1LL << b;
+	}
+	return 1LL << (LOCKPROF_BUCKETS - 1);
+}
+
+static void lockprof_report() {
+	fprintf(stderr, "\nLock profile (times in ns, percentiles rounded up to a power of 2)\n");
+	for (struct LockProf* p = lockprof_all; p; p = p->next) {
+		fprintf(stderr, "%s\n", p->name);
+		for (int i = 0; i < p->num_sites; i++) {
+			struct LockProfSite* s = &p->sites[i];
+			char** sym = s->site ? backtrace_symbols(&s->site, 1) : NULL;
+			fprintf(stderr, "  %s\n", sym ? sym[0] : "(other sites)");
+			free(sym);
+			if (s->acquisitions) {
+				fprintf(stderr, "    acquisitions %ld, contended %ld (%.1f%%)\n", s->acquisitions, s->contended,
+					100.0 * s->contended / s->acquisitions);
+				fprintf(stderr, "    wait: total %lld p50 %lld p99 %lld\n", s->wait_ns,
+					lockprof_percentile(s->wait_hist, s->acquisitions, 0.5), lockprof_percentile(s->wait_hist, s->acquisitions, 0.99));
+			}
+			if (s->cond_waits)
+				fprintf(stderr, "    cond waits %ld, signal and lock: total %lld p50 %lld p99 %lld\n", s->cond_waits, s->cond_ns,
+					lockprof_percentile(s->cond_hist, s->cond_waits, 0.5), lockprof_percentile(s->cond_hist, s->cond_waits, 0.99));
+			long held = s->acquisitions + s->cond_waits;
+			fprintf(stderr, "    hold: total %lld p50 %lld p99 %lld\n", s->hold_ns,
+				lockprof_percentile(s->hold_hist, held, 0.5), lockprof_percentile(s->hold_hist, held, 0.99));
+		}
+	}
+}
+
+// Not thread safe; create every profile before starting the threads.
+struct LockProf* lockprof_create(const char* name) {
+	struct LockProf* p = calloc(1, sizeof(struct LockProf));
+	p->name = name;
+	if (lockprof_all == NULL)
+		atexit(lockprof_report);
+	p->next = lockprof_all;
+	lockprof_all = p;
+	return p;
+}
+
+// Lock held.
+static struct LockProfSite* lockprof_site(struct LockProf* p, void* site) {
+	for (int i = 0; i < p->num_sites; i++)
+		if (p->sites[i].site == site)
+			return &p->sites[i];
+	if (p->num_sites == LOCKPROF_MAX_SITES)
+		return &p->sites[LOCKPROF_MAX_SITES];
+	p->sites[p->num_sites].site = site;
+	return &p->sites[p->num_sites++];
+}
+
+// Lock held.  cond is 1 when it was got back at the end of a condition variable
+// wait that started at wait_start.
+void lockprof_acquired(struct LockProf* p, void* site, int contended, long long wait_start, int cond) {
+	long long now = lockprof_ns();
+	struct LockProfSite* s = lockprof_site(p, site);
+	if (cond) {
+		s->cond_waits++;
+		s->cond_ns += now - wait_start;
+		s->cond_hist[lockprof_bucket(now - wait_start)]++;
+	}
+	else {
+		s->acquisitions++;
+		if (contended)
+			s->contended++;
+		s->wait_ns += now - wait_start;
+		s->wait_hist[lockprof_bucket(now - wait_start)]++;
+	}
+	p->held = 1;
+	p->since = now;
+	p->holder = s;
+}
+
+// Lock held, about to be released.
+void lockprof_released(struct LockProf* p) {
+	long long held = lockprof_ns() - p->since;
+	p->holder->hold_ns += held;
+	p->holder->hold_hist[lockprof_bucket(held)]++;
+	p->held = 0;
+}
+
+#define LOCKPROF_WRAPPER __attribute__((noinline))
+
+#define LOCKPROF_LOCK(p, acquire) { \
+	int       lockprof_contended = (p)->held; \
+	long long lockprof_start = lockprof_ns(); \
+	acquire; \
+	lockprof_acquired(p, __builtin_return_address(0), lockprof_contended, lockprof_start, 0); \
+}
+
+#define LOCKPROF_UNLOCK(p, release) { \
+	lockprof_released(p); \
+	release; \
+}
+
+#define LOCKPROF_COND_WAIT(p, wait) { \
+	lockprof_released(p); \
+	long long lockprof_start = lockprof_ns(); \
+	wait; \
+	lockprof_acquired(p, __builtin_return_address(0), 0, lockprof_start, 1); \
+}
+
+#else
+
+#define LOCKPROF_WRAPPER
+#define LOCKPROF_LOCK(p, acquire)   acquire;
+#define LOCKPROF_UNLOCK(p, release) release;
+#define LOCKPROF_COND_WAIT(p, wait) wait;
+
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/**
+ * Live metrics.
+ *
+ * With $METRICS_FILE set, a program that calls metrics_start publishes a
+ * snapshot of its counters to that file every $METRICS_INTERVAL_MS (default
+ * 1000) while it runs, and once more at exit.  metrics_watch prints them.
+ *
+ * The counters are the program's own statistics (histograms, counts), read in
+ * place by a publisher thread, and the operations and latencies recorded with
+ * bench.h.  The only extra work for the threads doing the work is that
+ * bench_latency keeps a sample of each interval's latencies, which the
+ * publisher takes and resets.  The snapshot
+ * is written under a sequence lock: seq is odd while it is being written, so a
+ * reader that sees the same even seq before and after copying it has a
+ * consistent copy.
+ */
+
+#define METRICS_MAGIC        0x3153434952544d53ULL  // "SMTRICS1"
+#define METRICS_MAX_COUNTERS 64
+#define METRICS_NAME_SIZE    32
+#define METRICS_SAMPLES      4096  // latencies kept per interval, past which they are a uniform sample
+
+struct MetricsCounter {
+	char    name[METRICS_NAME_SIZE];
+	int64_t value;
+};
+
+struct MetricsFile {
+	uint64_t magic;
+	uint32_t seq;
+	uint32_t done;            // 1 in the last snapshot, written at exit
+	int32_t  pid;
+	char     program[METRICS_NAME_SIZE];
+	int64_t  elapsed_ns;      // since bench_start
+	int64_t  ops;             // operations recorded so far
+	double   ops_per_second;  // over the last interval
+	int64_t  latency_ns[4];   // p50, p90, p99, max of the last interval's operations (sampled, see METRICS_SAMPLES)
+	uint32_t num_counters;
+	struct MetricsCounter counters[METRICS_MAX_COUNTERS];
+};
+
+// A consistent copy of *m; returns 0 if none could be had after many tries.
+static inline int metrics_read(volatile struct MetricsFile* m, struct MetricsFile* copy) {
+	for (int tries = 0; tries < 1000000; tries++) {
+		uint32_t seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		__builtin_memcpy(copy, (const void*) m, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq)
+			return 1;
+	}
+	return 0;
+}
+
+// The publishing half needs bench.h, included before this.
+#ifdef BENCH_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+struct MetricsSource {
+	const char* name;
+	int*        values;
+	int         n;  // 1 for a single counter, else values is an array published as name[i]
+};
+
+struct MetricsFile*  metrics_file;
+struct MetricsSource metrics_sources[METRICS_MAX_COUNTERS];
+int                  metrics_num_sources;
+int                  metrics_interval_ms = 1000;
+int                  metrics_stopping;
+pthread_t            metrics_thread;
+pthread_mutex_t      metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t       metrics_stop_cond = PTHREAD_COND_INITIALIZER;
+long                 metrics_last_ops;
+long long            metrics_last_ns;
+long long*           metrics_window;  // this interval's latency samples, sorted
+
+// Call before metrics_start.
+void metrics_int(const char* name, int* value) {
+	if (metrics_num_sources < METRICS_MAX_COUNTERS)
+		metrics_sources[metrics_num_sources++] = (struct MetricsSource) { name, value, 1 };
+}
+
+// Call before metrics_start.
+void metrics_ints(const char* name, int* values, int n) {
+	if (metrics_num_sources < METRICS_MAX_COUNTERS)
+		metrics_sources[metrics_num_sources++] = (struct MetricsSource) { name, values, n };
+}
+
+static void metrics_publish(int done) {
+	struct MetricsFile* m = metrics_file;
+	long long now = bench_now();
+	long ops = __atomic_load_n(&bench_num_latencies, __ATOMIC_RELAXED);
+
+	// the interval's latency samples, starting the next interval's; a sample still
+	// being written may be off or already belong to the next one, which is harmless here
+	long taken = __atomic_exchange_n(&bench_interval_num, 0, __ATOMIC_RELAXED);
+	long n = taken < bench_interval_max ? taken : bench_interval_max;
+	memcpy(metrics_window, bench_interval_latencies, n * sizeof(long long));
+	qsort(metrics_window, n, sizeof(long long), bench_compare);
+
+	__atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	m->done = done;
+	m->elapsed_ns = now - bench_start_ns;
+	m->ops = ops;
+	m->ops_per_second = now > metrics_last_ns ? (ops - metrics_last_ops) * 1e9 / (now - metrics_last_ns) : 0;
+	m->latency_ns[0] = n ? metrics_window[n / 2] : 0;
+	m->latency_ns[1] = n ? metrics_window[(long) (0.9 * n)] : 0;
+	m->latency_ns[2] = n ? metrics_window[(long) (0.99 * n)] : 0;
+	m->latency_ns[3] = n ? metrics_window[n - 1] : 0;
+	int c = 0;
+	for (int i = 0; i < metrics_num_sources; i++) {
+		struct MetricsSource* s = &metrics_sources[i];
+		for (int j = 0; j < s->n && c < METRICS_MAX_COUNTERS; j++, c++)
+			m->counters[c].value = __atomic_load_n(&s->values[j], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+
+	metrics_last_ops = ops;
+	metrics_last_ns = now;
+}
+
+// A plain pthread, so it keeps publishing whatever the uthreads are doing.
+static void* metrics_publisher(void* v) {
+	struct timespec next;
+	clock_gettime(CLOCK_REALTIME, &next);
+	pthread_mutex_lock(&metrics_mutex);
+	while (!metrics_stopping) {
+		next.tv_nsec += metrics_interval_ms % 1000 * 1000000L;
+		next.tv_sec += metrics_interval_ms / 1000 + next.tv_nsec / 1000000000L;
+		next.tv_nsec %= 1000000000L;
+		while (!metrics_stopping && pthread_cond_timedwait(&metrics_stop_cond, &metrics_mutex, &next) == 0)
+			;
+		if (!metrics_stopping)
+			metrics_publish(0);
+	}
+	pthread_mutex_unlock(&metrics_mutex);
+	return NULL;
+}
+
+static void metrics_stop() {
+	pthread_mutex_lock(&metrics_mutex);
+	metrics_stopping = 1;
+	pthread_cond_signal(&metrics_stop_cond);
+	pthread_mutex_unlock(&metrics_mutex);
+	pthread_join(metrics_thread, NULL);
+	metrics_publish(1);
+	munmap(metrics_file, sizeof(struct MetricsFile));
+}
+
+// After bench_start; does nothing unless $METRICS_FILE is set.
+void metrics_start(const char* program) {
+	const char* name = getenv("METRICS_FILE");
+	if (name == NULL)
+		return;
+	if (getenv("METRICS_INTERVAL_MS") && atoi(getenv("METRICS_INTERVAL_MS")) > 0)
+		metrics_interval_ms = atoi(getenv("METRICS_INTERVAL_MS"));
+	int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof(struct MetricsFile)) < 0) {
+		perror(name);
+		return;
+	}
+	metrics_file = mmap(NULL, sizeof(struct MetricsFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (metrics_file == MAP_FAILED) {
+		perror(name);
+		metrics_file = NULL;
+		return;
+	}
+
+	const char* slash = strrchr(program, '/');
+	struct MetricsFile* m = metrics_file;
+	m->pid = getpid();
+	snprintf(m->program, METRICS_NAME_SIZE, "%s", slash ? slash + 1 : program);
+	for (int i = 0; i < metrics_num_sources; i++) {
+		struct MetricsSource* s = &metrics_sources[i];
+		for (int j = 0; j < s->n && m->num_counters < METRICS_MAX_COUNTERS; j++, m->num_counters++) {
+			if (s->n == 1)
+				snprintf(m->counters[m->num_counters].name, METRICS_NAME_SIZE, "%s", s->name);
+			else
+				snprintf(m->counters[m->num_counters].name, METRICS_NAME_SIZE, "%s[%d]", s->name, j);
+		}
+	}
+	__atomic_store_n(&m->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+
+	metrics_window = malloc(METRICS_SAMPLES * sizeof(long long));
+	bench_interval_max = METRICS_SAMPLES;
+	__atomic_store_n(&bench_interval_latencies, malloc(METRICS_SAMPLES * sizeof(long long)), __ATOMIC_RELEASE);
+	metrics_last_ns = bench_start_ns;
+	pthread_create(&metrics_thread, NULL, metrics_publisher, NULL);
+	atexit(metrics_stop);
+}
+
+#endif
+
+#endif
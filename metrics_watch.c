@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "metrics.h"
+
+/**
+ * Print the live metrics of a running program (see metrics.h).
+ *
+ *   METRICS_FILE=well.stats ./well num_people=1000 &
+ *   metrics_watch well.stats [interval_ms]
+ *
+ * Prints a snapshot every interval_ms (default 1000) with each counter's
+ * change per second since the previous one, until the program exits.
+ */
+
+int main(int argc, char** argv) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s stats_file [interval_ms]\n", argv[0]);
+		return 1;
+	}
+	int interval_ms = argc == 3 ? atoi(argv[2]) : 1000;
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	volatile struct MetricsFile* m = mmap(NULL, sizeof(struct MetricsFile), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	struct MetricsFile now, last = { 0 };
+	int have_last = 0;
+	while (1) {
+		if (m->magic != METRICS_MAGIC || !metrics_read(m, &now)) {
+			usleep(interval_ms * 1000);
+			continue;
+		}
+		if (!have_last || now.seq != last.seq) {
+			double dt = have_last ? (now.elapsed_ns - last.elapsed_ns) / 1e9 : 0;
+			printf("%s (pid %d)%s  %.1f s  %lld ops  %.0f ops/s  latency ns p50 %lld p90 %lld p99 %lld max %lld\n",
+				now.program, now.pid, now.done ? " done" : "", now.elapsed_ns / 1e9, (long long) now.ops,
+				now.ops_per_second, (long long) now.latency_ns[0], (long long) now.latency_ns[1],
+				(long long) now.latency_ns[2], (long long) now.latency_ns[3]);
+			for (int i = 0; i < now.num_counters && i < METRICS_MAX_COUNTERS; i++) {
+				printf("  %-24s %12lld", now.counters[i].name, (long long) now.counters[i].value);
+				if (dt > 0)
+					printf("  %+.1f/s", (now.counters[i].value - last.counters[i].value) / dt);
+				printf("\n");
+			}
+			fflush(stdout);
+			last = now;
+			have_last = 1;
+		}
+		if (now.done)
+			return 0;
+		if (kill(now.pid, 0) < 0) {
+			printf("%s (pid %d) is gone\n", now.program, now.pid);
+			return 1;
+		}
+		usleep(interval_ms * 1000);
+	}
+}
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include "uthread.h"
+#include "coro.h"
+
+/**
+ * pc_sem.c with producers and consumers run as stackless coroutines.  The
+ * three semaphores are coroutine semaphores; a worker that would block on one
+ * parks itself and returns to its event loop.
+ */
+
+#ifndef MAX_ITEMS
+#define MAX_ITEMS      10
+#endif
+#ifndef NUM_ITERATIONS
+#define NUM_ITERATIONS 200
+#endif
+#ifndef NUM_PRODUCERS
+#define NUM_PRODUCERS  2
+#endif
+#ifndef NUM_CONSUMERS
+#define NUM_CONSUMERS  2
+#endif
+#ifndef NUM_PROCESSORS
+#define NUM_PROCESSORS 4
+#endif
+
+struct CoroSem* space;
+struct CoroSem* items_available;
+struct CoroSem* mutual_exclusion;
+
+// histogram [i] == # of times list stored i items
+int histogram[MAX_ITEMS + 1];
+
+// number of items currently produced but not yet consumed
+// invariant that you must maintain: 0 >= items >= MAX_ITEMS
+int items_produced = 0;
+
+// resume points of a worker
+enum WorkerState { START = 0, GOT_SLOT, IN_CRITICAL };
+
+struct Worker {
+	struct Coro c;
+	int         is_producer;
+	int         i;  // iteration
+};
+
+// One step of producer() or consumer() from pc_sem.c, resumed at w->c.state.
+enum CoroStatus worker_step(struct Coro* c) {
+	struct Worker* w = (struct Worker*) c;
+	struct CoroSem* first = w->is_producer ? space : items_available;
+	struct CoroSem* last  = w->is_producer ? items_available : space;
+
+	switch (c->state) {
+	case START:
+		c->state = GOT_SLOT;
+		if (!coro_sem_wait(first, c))
+			return CORO_BLOCKED;
+		// fall through
+	case GOT_SLOT:
+		c->state = IN_CRITICAL;
+		if (!coro_sem_wait(mutual_exclusion, c))
+			return CORO_BLOCKED;
+		// fall through
+	case IN_CRITICAL:
+		items_produced += w->is_producer ? 1 : -1;
+		assert(items_produced >= 0 && items_produced <= MAX_ITEMS);
+		histogram[items_produced] ++;
+		coro_sem_signal(mutual_exclusion);
+		coro_sem_signal(last);
+
+		c->state = START;
+		return ++w->i == NUM_ITERATIONS ? CORO_DONE : CORO_YIELD;
+	}
+	assert(0);
+	return CORO_DONE;
+}
+
+int main(int argc, char** argv) {
+
+	// init the thread system
+	uthread_init(NUM_PROCESSORS);
+	coro_init(NUM_PROCESSORS, worker_step);
+
+	space = coro_sem_create(MAX_ITEMS);
+	items_available = coro_sem_create(0);
+	mutual_exclusion = coro_sem_create(1);
+
+	// spread the workers over the loops
+	struct Worker* workers = calloc(NUM_PRODUCERS + NUM_CONSUMERS, sizeof(struct Worker));
+	for (int i = 0; i < NUM_PRODUCERS + NUM_CONSUMERS; i++) {
+		workers[i].is_producer = i < NUM_PRODUCERS;
+		coro_spawn(&workers[i].c, i % NUM_PROCESSORS);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	coro_run();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	// sum up
+	printf("items value histogram:\n");
+	int sum = 0;
+	for (int i = 0; i <= MAX_ITEMS; i++) {
+		printf("  items=%d, %d times\n", i, histogram[i]);
+		sum += histogram[i];
+	}
+	// checks invariant that ever change to items was recorded in histogram exactly one
+	assert(sum == (NUM_PRODUCERS + NUM_CONSUMERS) * NUM_ITERATIONS);
+	printf("Memory per worker: %zu bytes\n", sizeof(struct Worker));
+	printf("Operations per second: %.0f\n", sum / elapsed);
+}
@@ -2,79 +2,267 @@
 #include <stdio.h>
 #include <assert.h>
 #include "uthread.h"
-#include "uthread_sem.h"
+#include "fast_sem.h"
+#include "bench.h"
+#include "metrics.h"
 
-#define MAX_ITEMS      10
-#define NUM_ITERATIONS 200
-#define NUM_PRODUCERS  2
-#define NUM_CONSUMERS  2
-#define NUM_PROCESSORS 4
+// What a producer does when the buffer is full.
+enum Policy { BLOCK, DROP_NEWEST, OVERWRITE_OLDEST };
+const char* policy_name[] = { "block", "drop newest", "overwrite oldest" };
 
-uthread_sem_t space;
-uthread_sem_t items_available;
-uthread_sem_t mutual_exclusion;
+// What a consumer does when the buffer is empty: wait, try again after a
+// yield, or try again until MAX_WAIT_US has passed.
+enum ConsumerPolicy { CONSUME_BLOCK, CONSUME_TRY, CONSUME_TIMED };
+const char* consumer_policy_name[] = { "block", "try", "timed" };
+
+// defaults, each can be changed on the command line (see bench.h)
+int MAX_ITEMS       = 10;
+int NUM_ITERATIONS  = 200;  // per producer
+int NUM_PRODUCERS   = 2;
+int NUM_CONSUMERS   = 2;
+int NUM_PROCESSORS  = 4;
+int POLICY          = BLOCK;
+int CONSUMER_POLICY = CONSUME_BLOCK;
+int MAX_WAIT_US     = 0;    // DROP_NEWEST and CONSUME_TIMED: how long to wait before giving up
+int CONSUMER_DELAY  = 0;    // yields after each consume, to slow consumers down
+
+struct Param params[] = {
+	{ "max_items",       &MAX_ITEMS,      1 },
+	{ "num_iterations",  &NUM_ITERATIONS, 1 },
+	{ "num_producers",   &NUM_PRODUCERS,  1 },
+	{ "num_consumers",   &NUM_CONSUMERS,  1 },
+	{ "num_processors",  &NUM_PROCESSORS, 1 },
+	{ "policy",          &POLICY },
+	{ "consumer_policy", &CONSUMER_POLICY },
+	{ "max_wait_us",     &MAX_WAIT_US },
+	{ "consumer_delay",  &CONSUMER_DELAY },
+	{ NULL, NULL }
+};
+
+fast_sem_t space;
+fast_sem_t items_available;
+fast_sem_t mutual_exclusion;
 
 // histogram [i] == # of times list stored i items
-int histogram[MAX_ITEMS + 1];
+int* histogram;
 
 // number of items currently produced but not yet consumed
 // invariant that you must maintain: 0 >= items >= MAX_ITEMS
 int items_produced = 0;
 
-// if necessary wait until items < MAX_ITEMS and then increment items
+int drops;           // items not produced because the buffer was full, atomic
+int overwrites;      // items produced in place of the oldest one, atomic
+int consumed;        // atomic
+int empty_tries;     // non-blocking consumes that found nothing, atomic
+int producers_done;  // under mutual_exclusion
+
+// holding space; increment items
 // assertion checks the invariant that 0 >= items >= MAX_ITEMS
+void add_item() {
+	fast_sem_wait(mutual_exclusion);
+	items_produced += 1;
+	assert(items_produced >= 0 && items_produced <= MAX_ITEMS);
+	histogram[items_produced] ++;
+	fast_sem_signal(mutual_exclusion);
+	if (fast_sem_signal(items_available))
+		bench_wakeup(1);
+}
+
+// holding an item; decrement items
+// assertion checks the invariant that 0 >= items >= MAX_ITEMS
+void remove_item() {
+	fast_sem_wait(mutual_exclusion);
+	items_produced -= 1;
+	assert(items_produced >= 0 && items_produced <= MAX_ITEMS);
+	histogram[items_produced] ++;
+	fast_sem_signal(mutual_exclusion);
+	if (fast_sem_signal(space))
+		bench_wakeup(1);
+}
+
+// if necessary wait until items < MAX_ITEMS and then increment items
+void produce() {
+	fast_sem_wait(space);
+	add_item();
+}
+
+// increment items if items < MAX_ITEMS; returns whether it did
+int try_produce() {
+	if (!fast_sem_trywait(space))
+		return 0;
+	add_item();
+	return 1;
+}
+
+// like produce, but gives up at deadline (a bench_now() time); returns whether it produced.
+// uthread semaphores cannot time out, so this does not block: it spins, trying
+// and yielding, until it produces or the deadline passes.
+int produce_until(long long deadline) {
+	while (!try_produce()) {
+		if (bench_now() >= deadline)
+			return 0;
+		uthread_yield();
+	}
+	return 1;
+}
+
+// decrement items if items > 0; returns whether it did
+int try_consume() {
+	if (!fast_sem_trywait(items_available))
+		return 0;
+	remove_item();
+	return 1;
+}
+
+// like try_consume, but keeps trying until deadline (a bench_now() time); returns
+// whether it consumed.  Spins like produce_until.
+int consume_until(long long deadline) {
+	while (!try_consume()) {
+		if (bench_now() >= deadline)
+			return 0;
+		uthread_yield();
+	}
+	return 1;
+}
+
+// Replace the oldest item with a new one if items > 0; returns whether it did.
+// Items goes down and back up, so that is two changes in the histogram.
+int overwrite_oldest() {
+	if (!fast_sem_trywait(items_available))
+		return 0;
+	fast_sem_wait(mutual_exclusion);
+	items_produced -= 1;
+	histogram[items_produced] ++;
+	items_produced += 1;
+	histogram[items_produced] ++;
+	fast_sem_signal(mutual_exclusion);
+	fast_sem_signal(items_available);
+	return 1;
+}
+
+// produce according to POLICY; only BLOCK ever waits for a consumer
 void* producer(void* v) {
 	for (int i = 0; i < NUM_ITERATIONS; i++) {
-		uthread_sem_wait(space);
-		uthread_sem_wait(mutual_exclusion);
-
-		items_produced += 1;
-		assert(items_produced >= 0 && items_produced <= MAX_ITEMS);
-		histogram[items_produced] ++;
-		uthread_sem_signal(mutual_exclusion);
-		uthread_sem_signal(items_available);
+		long long start = bench_now();
+		switch (POLICY) {
+		case BLOCK:
+			produce();
+			break;
+		case DROP_NEWEST:
+			if (!(MAX_WAIT_US ? produce_until(start + MAX_WAIT_US * 1000LL) : try_produce()))
+				__atomic_fetch_add(&drops, 1, __ATOMIC_RELAXED);
+			break;
+		case OVERWRITE_OLDEST:
+			// neither works only while consumers are between taking an item and freeing its space
+			while (!try_produce()) {
+				if (overwrite_oldest()) {
+					__atomic_fetch_add(&overwrites, 1, __ATOMIC_RELAXED);
+					break;
+				}
+				uthread_yield();
+			}
+			break;
+		}
+		bench_latency(bench_now() - start);
 	}
 	return NULL;
 }
 
-// if necessary wait until items > 0 and then decrement items
-// assertion checks the invariant that 0 >= items >= MAX_ITEMS
-void* consumer(void* v) {
-	for (int i = 0; i < NUM_ITERATIONS; i++) {
-		uthread_sem_wait(items_available);
-		uthread_sem_wait(mutual_exclusion);
+// consume with try_consume or consume_until until the producers are done and
+// nothing is left; main sends no extra signals for these
+void* polling_consumer(void* v) {
+	while (1) {
+		if (CONSUMER_POLICY == CONSUME_TRY ? try_consume() : consume_until(bench_now() + MAX_WAIT_US * 1000LL)) {
+			__atomic_fetch_add(&consumed, 1, __ATOMIC_RELAXED);
+			for (int j = 0; j < CONSUMER_DELAY; j++)
+				uthread_yield();
+			continue;
+		}
+		__atomic_fetch_add(&empty_tries, 1, __ATOMIC_RELAXED);
+		// once the producers are done, every item left has been signalled, so
+		// finding none available means none are left
+		fast_sem_wait(mutual_exclusion);
+		int done = producers_done && items_produced == 0;
+		fast_sem_signal(mutual_exclusion);
+		if (done)
+			return NULL;
+		uthread_yield();
+	}
+}
 
+// consume until the producers are done and nothing is left
+void* consumer(void* v) {
+	while (1) {
+		fast_sem_wait(items_available);
+		fast_sem_wait(mutual_exclusion);
+		if (items_produced == 0 && producers_done) {
+			// one of the extra signals main sends when the producers are done
+			fast_sem_signal(mutual_exclusion);
+			return NULL;
+		}
+		// remove_item, but without letting go of mutual_exclusion after the check,
+		// or another consumer holding an extra signal could take the same item
 		items_produced -= 1;
 		assert(items_produced >= 0 && items_produced <= MAX_ITEMS);
 		histogram[items_produced] ++;
-
-		uthread_sem_signal(mutual_exclusion);
-		uthread_sem_signal(space);
+		fast_sem_signal(mutual_exclusion);
+		if (fast_sem_signal(space))
+			bench_wakeup(1);
+		__atomic_fetch_add(&consumed, 1, __ATOMIC_RELAXED);
+		for (int j = 0; j < CONSUMER_DELAY; j++)
+			uthread_yield();
 	}
-	return NULL;
 }
 
 int main(int argc, char** argv) {
+	bench_init(argc, argv, params);
+	if (POLICY < BLOCK || POLICY > OVERWRITE_OLDEST) {
+		fprintf(stderr, "policy: 0 block, 1 drop newest, 2 overwrite oldest\n");
+		return 1;
+	}
+	if (CONSUMER_POLICY < CONSUME_BLOCK || CONSUMER_POLICY > CONSUME_TIMED) {
+		fprintf(stderr, "consumer_policy: 0 block, 1 try, 2 timed\n");
+		return 1;
+	}
+	histogram = calloc(MAX_ITEMS + 1, sizeof(int));
 
 	// init the thread system
 	uthread_init(NUM_PROCESSORS);
 
-	space = uthread_sem_create(MAX_ITEMS);
-	items_available = uthread_sem_create(0);
-	mutual_exclusion = uthread_sem_create(1);
+	space = fast_sem_create(MAX_ITEMS);
+	items_available = fast_sem_create(0);
+	mutual_exclusion = fast_sem_create(1);
 
 	// start the threads
+	bench_start(NUM_PRODUCERS * NUM_ITERATIONS);
+	metrics_int("items", &items_produced);
+	metrics_int("consumed", &consumed);
+	metrics_int("drops", &drops);
+	metrics_int("overwrites", &overwrites);
+	metrics_int("empty_tries", &empty_tries);
+	metrics_ints("histogram", histogram, MAX_ITEMS + 1);
+	metrics_start(argv[0]);
 	uthread_t threads[NUM_PRODUCERS + NUM_CONSUMERS];
 	for (int i = 0; i < NUM_PRODUCERS; i++)
 		threads[i] = uthread_create(producer, NULL);
 	for (int i = NUM_PRODUCERS; i < NUM_PRODUCERS + NUM_CONSUMERS; i++)
-		threads[i] = uthread_create(consumer, NULL);
+		threads[i] = uthread_create(CONSUMER_POLICY == CONSUME_BLOCK ? consumer : polling_consumer, NULL);
 
 
 
-	// wait for threads to complete
-	for (int i = 0; i < NUM_PRODUCERS + NUM_CONSUMERS; i++)
+	// wait for threads to complete; once the producers are, one more signal
+	// per consumer lets each of them find out that nothing is left
+	for (int i = 0; i < NUM_PRODUCERS; i++)
+		uthread_join(threads[i], NULL);
+	fast_sem_wait(mutual_exclusion);
+	producers_done = 1;
+	fast_sem_signal(mutual_exclusion);
+	if (CONSUMER_POLICY == CONSUME_BLOCK)
+		for (int i = 0; i < NUM_CONSUMERS; i++)
+			fast_sem_signal(items_available);
+	for (int i = NUM_PRODUCERS; i < NUM_PRODUCERS + NUM_CONSUMERS; i++)
 		uthread_join(threads[i], NULL);
+	bench_stop();
 
 	// sum up
 	printf("items value histogram:\n");
@@ -83,6 +271,14 @@ int main(int argc, char** argv) {
 		printf("  items=%d, %d times\n", i, histogram[i]);
 		sum += histogram[i];
 	}
-	// checks invariant that ever change to items was recorded in histogram exactly one
-	assert(sum == (NUM_PRODUCERS + NUM_CONSUMERS) * NUM_ITERATIONS);
+	int attempts = NUM_PRODUCERS * NUM_ITERATIONS;
+	printf("policy %s: %d produced, %d dropped, %d overwritten, %d consumed\n",
+		policy_name[POLICY], attempts - drops, drops, overwrites, consumed);
+	if (CONSUMER_POLICY != CONSUME_BLOCK)
+		printf("consumer policy %s: %d tries found nothing\n", consumer_policy_name[CONSUMER_POLICY], empty_tries);
+	// every item that got in was consumed or overwritten, and every change to
+	// items (two for an overwrite) was recorded in histogram exactly once
+	assert(consumed == attempts - drops - overwrites);
+	assert(sum == 2 * (attempts - drops));
+	bench_report(argv[0], attempts);
 }
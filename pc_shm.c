@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "bench.h"
+
+/**
+ * The bounded buffer of pc_sem between processes instead of uthreads.
+ *
+ * The buffer lives in a shared mapping and producers and consumers are
+ * separate processes, so there are no uthread semaphores: space and
+ * items_available are counting semaphores on plain words in the mapping that
+ * park on futexes (process-shared, Linux only).  A slot is filled and read
+ * where it is (shm_produce_begin/end, shm_consume_begin/end), so a message is
+ * written once and never copied through the kernel.
+ *
+ * With pipe=1 the same processes pass the same messages through a pipe
+ * instead, as the baseline.  Latency is from just before a producer starts
+ * writing a message to just after a consumer has it.
+ */
+
+// defaults, each can be changed on the command line (see bench.h)
+int NUM_MESSAGES  = 1000000;  // in total
+int MESSAGE_SIZE  = 64;       // bytes, at least sizeof(struct Message)
+int NUM_SLOTS     = 64;
+int NUM_PRODUCERS = 1;        // processes
+int NUM_CONSUMERS = 1;        // processes
+int PIPE          = 0;        // 1: pass the messages through a pipe
+
+struct Param params[] = {
+	{ "num_messages",  &NUM_MESSAGES,  1 },
+	{ "message_size",  &MESSAGE_SIZE,  1 },
+	{ "num_slots",     &NUM_SLOTS,     1 },
+	{ "num_producers", &NUM_PRODUCERS, 1 },
+	{ "num_consumers", &NUM_CONSUMERS, 1 },
+	{ "pipe",          &PIPE },
+	{ NULL, NULL }
+};
+
+struct Message {
+	long long sent_ns;
+	int       id;
+};
+
+static long futex(int* word, int op, int value) {
+	return syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+long* futex_wakeups;  // shared; waiters that FUTEX_WAKE woke
+
+static void futex_wake(int* word, int n) {
+	long woken = futex(word, FUTEX_WAKE, n);
+	if (woken > 0)
+		__atomic_fetch_add(futex_wakeups, woken, __ATOMIC_RELAXED);
+}
+
+// Process-shared counting semaphore; waiters only tells signal whether to make the syscall.
+struct ShmSem {
+	int value;
+	int waiters;
+} __attribute__((aligned(64)));
+
+void shm_sem_wait(struct ShmSem* s) {
+	int v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+	while (1) {
+		if (v > 0) {
+			if (__atomic_compare_exchange_n(&s->value, &v, v - 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+		__atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+		futex(&s->value, FUTEX_WAIT, 0);  // returns at once unless value is still 0
+		__atomic_fetch_sub(&s->waiters, 1, __ATOMIC_RELAXED);
+		v = __atomic_load_n(&s->value, __ATOMIC_RELAXED);
+	}
+}
+
+void shm_sem_signal(struct ShmSem* s) {
+	__atomic_fetch_add(&s->value, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&s->value, 1);
+}
+
+/**
+ * Slot i is used for positions i, i + num_slots, ...  Its seq is pos while it
+ * is free for the producer of pos and pos + 1 once that producer is done, so
+ * with several producers or consumers each one waits for its own slot even
+ * when the one before it is slow.
+ */
+struct ShmSlot {
+	unsigned seq;
+	int      waiters;
+	char     data[];
+};
+
+struct ShmBuffer {
+	struct ShmSem space;
+	struct ShmSem items_available;
+	unsigned      tail __attribute__((aligned(64)));  // next position to produce
+	unsigned      head __attribute__((aligned(64)));  // next position to consume
+	long          wakeups __attribute__((aligned(64)));  // see futex_wakeups
+	int           num_slots;
+	int           slot_size;  // bytes from one slot to the next
+	char          slots[] __attribute__((aligned(64)));
+};
+
+struct ShmSlot* shm_slot(struct ShmBuffer* b, unsigned pos) {
+	return (struct ShmSlot*) (b->slots + (size_t) (pos % b->num_slots) * b->slot_size);
+}
+
+static void shm_slot_wait(struct ShmSlot* s, unsigned seq) {
+	unsigned v;
+	while ((v = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) != seq) {
+		__atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+		futex((int*) &s->seq, FUTEX_WAIT, (int) v);
+		__atomic_fetch_sub(&s->waiters, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void shm_slot_set(struct ShmSlot* s, unsigned seq) {
+	__atomic_store_n(&s->seq, seq, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST))
+		futex_wake((int*) &s->seq, INT_MAX);
+}
+
+// Shared by every process forked after this.
+struct ShmBuffer* shm_buffer_create(int num_slots, int message_size) {
+	int slot_size = (sizeof(struct ShmSlot) + message_size + 63) & ~63;
+	struct ShmBuffer* b = mmap(NULL, sizeof(struct ShmBuffer) + (size_t) num_slots * slot_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (b == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	b->space.value = num_slots;
+	futex_wakeups = &b->wakeups;
+	b->num_slots = num_slots;
+	b->slot_size = slot_size;
+	for (int i = 0; i < num_slots; i++)
+		shm_slot(b, i)->seq = i;
+	return b;
+}
+
+// If necessary wait for space; returns the slot to write the message in.
+struct ShmSlot* shm_produce_begin(struct ShmBuffer* b, unsigned* pos) {
+	shm_sem_wait(&b->space);
+	*pos = __atomic_fetch_add(&b->tail, 1, __ATOMIC_RELAXED);
+	struct ShmSlot* s = shm_slot(b, *pos);
+	shm_slot_wait(s, *pos);
+	return s;
+}
+
+void shm_produce_end(struct ShmBuffer* b, struct ShmSlot* s, unsigned pos) {
+	shm_slot_set(s, pos + 1);
+	shm_sem_signal(&b->items_available);
+}
+
+// If necessary wait for an item; returns the slot to read it from.
+struct ShmSlot* shm_consume_begin(struct ShmBuffer* b, unsigned* pos) {
+	shm_sem_wait(&b->items_available);
+	*pos = __atomic_fetch_add(&b->head, 1, __ATOMIC_RELAXED);
+	struct ShmSlot* s = shm_slot(b, *pos);
+	shm_slot_wait(s, *pos + 1);
+	return s;
+}
+
+void shm_consume_end(struct ShmBuffer* b, struct ShmSlot* s, unsigned pos) {
+	shm_slot_set(s, pos + b->num_slots);
+	shm_sem_signal(&b->space);
+}
+
+struct ShmBuffer* buffer;
+int               pipe_fds[2];
+long long*        latencies;  // shared, by message id
+
+// the messages producer p sends, or consumer p receives
+int share(int p, int n) {
+	return NUM_MESSAGES / n + (p < NUM_MESSAGES % n);
+}
+
+void fill(struct Message* m, int id) {
+	memset(m + 1, id, MESSAGE_SIZE - sizeof(struct Message));
+	m->id = id;
+	m->sent_ns = bench_now();
+}
+
+// the id of the first message producer p sends
+int first_id(int p) {
+	int id = 0;
+	for (int i = 0; i < p; i++)
+		id += share(i, NUM_PRODUCERS);
+	return id;
+}
+
+void producer(int p) {
+	int id = first_id(p);
+	char* m = malloc(MESSAGE_SIZE);
+	for (int i = 0; i < share(p, NUM_PRODUCERS); i++, id++) {
+		if (PIPE) {
+			fill((struct Message*) m, id);
+			if (write(pipe_fds[1], m, MESSAGE_SIZE) != MESSAGE_SIZE) {
+				perror("write");
+				exit(1);
+			}
+		}
+		else {
+			unsigned pos;
+			struct ShmSlot* s = shm_produce_begin(buffer, &pos);
+			fill((struct Message*) s->data, id);
+			shm_produce_end(buffer, s, pos);
+		}
+	}
+}
+
+void consumer(int p) {
+	char* m = malloc(MESSAGE_SIZE);
+	for (int i = 0; i < share(p, NUM_CONSUMERS); i++) {
+		struct Message* msg;
+		if (PIPE) {
+			// writes of at most PIPE_BUF are atomic, so this is always a whole message
+			if (read(pipe_fds[0], m, MESSAGE_SIZE) != MESSAGE_SIZE) {
+				perror("read");
+				exit(1);
+			}
+			msg = (struct Message*) m;
+			latencies[msg->id] = bench_now() - msg->sent_ns;
+		}
+		else {
+			unsigned pos;
+			struct ShmSlot* s = shm_consume_begin(buffer, &pos);
+			msg = (struct Message*) s->data;
+			latencies[msg->id] = bench_now() - msg->sent_ns;
+			shm_consume_end(buffer, s, pos);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	bench_init(argc, argv, params);
+	if (MESSAGE_SIZE < sizeof(struct Message) || (PIPE && MESSAGE_SIZE > PIPE_BUF)) {
+		fprintf(stderr, "message_size must be at least %zu (and at most %d with pipe=1)\n",
+			sizeof(struct Message), PIPE_BUF);
+		return 1;
+	}
+	latencies = mmap(NULL, NUM_MESSAGES * sizeof(long long), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (latencies == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	if (PIPE) {
+		if (pipe(pipe_fds) < 0) {
+			perror("pipe");
+			return 1;
+		}
+	}
+	else
+		buffer = shm_buffer_create(NUM_SLOTS, MESSAGE_SIZE);
+
+	bench_start(NUM_MESSAGES);
+	for (int i = 0; i < NUM_PRODUCERS + NUM_CONSUMERS; i++)
+		if (fork() == 0) {
+			if (i < NUM_PRODUCERS)
+				producer(i);
+			else
+				consumer(i - NUM_PRODUCERS);
+			exit(0);
+		}
+	int status, failed = 0;
+	while (wait(&status) > 0)
+		failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	bench_stop();
+	if (failed)
+		return 1;
+
+	for (int i = 0; i < NUM_MESSAGES; i++)
+		bench_latency(latencies[i]);
+	if (!PIPE) {
+		assert(buffer->head == NUM_MESSAGES && buffer->tail == NUM_MESSAGES);
+		bench_wakeups = buffer->wakeups;
+	}
+	printf("%s: %d messages of %d bytes, %.0f per second\n", PIPE ? "pipe" : "shared memory",
+		NUM_MESSAGES, MESSAGE_SIZE, NUM_MESSAGES / (bench_elapsed_ns / 1e9));
+	bench_report(argv[0], NUM_MESSAGES);
+}
@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "uthread.h"
+#include "uthread_mutex_cond.h"
+#include "fast_sem.h"
+#include "poll_cond.h"
+#include "bench.h"
+
+/**
+ * A consumer that has both a pc_sem style bounded buffer and a pipe to
+ * service.
+ *
+ * With poll=1 one consumer thread waits for either in a single epoll_wait,
+ * on the pipe and on the buffer's pollable items_available semaphore (see
+ * fast_sem.h), or its pollable not_empty condition with cond=1 (see
+ * poll_cond.h).  With poll=0 it takes two consumer threads, one blocked on
+ * the buffer and one blocked in read on the pipe, as the baseline.  With
+ * num_pollers=2 or more, poll=1 has that many such consumers, all polling the
+ * same pipe and the same semaphore or condition.
+ *
+ * Every item and message carries the time it was sent; latency is until the
+ * consumer has it.  A thread blocked in epoll_wait or read holds up its
+ * processor, so num_processors should be more than the number of them.
+ */
+
+// defaults, each can be changed on the command line (see bench.h)
+int MAX_ITEMS      = 10;
+int NUM_ITEMS      = 100000;  // per producer
+int NUM_PRODUCERS  = 2;
+int NUM_MESSAGES   = 100000;  // through the pipe
+int MESSAGE_SIZE   = 64;
+int POLL           = 1;
+int COND           = 0;       // 1: the buffer signals with a condition variable, not semaphores
+int NUM_PROCESSORS = 4;
+int NUM_POLLERS    = 1;       // poll=1: consumers in epoll
+
+struct Param params[] = {
+	{ "max_items",      &MAX_ITEMS,      1 },
+	{ "num_items",      &NUM_ITEMS,      1 },
+	{ "num_producers",  &NUM_PRODUCERS,  1 },
+	{ "num_messages",   &NUM_MESSAGES,   1 },
+	{ "message_size",   &MESSAGE_SIZE,   1 },
+	{ "poll",           &POLL },
+	{ "cond",           &COND },
+	{ "num_processors", &NUM_PROCESSORS, 1 },
+	{ "num_pollers",    &NUM_POLLERS,    1 },
+	{ NULL, NULL }
+};
+
+// the buffer: send times of the items in it, oldest at head
+uthread_mutex_t mx;
+long long*      ring;
+int             head;
+int             count;
+fast_sem_t      space;            // semaphores
+fast_sem_t      items_available;
+poll_cond_t     not_empty;        // cond=1
+uthread_cond_t  not_full;
+
+int pipe_fds[2];
+
+// poll=1
+int             items_left;     // atomic
+int             messages_left;  // atomic, changed under pipe_mx
+uthread_mutex_t pipe_mx;        // a poller reads a whole message at a time
+int             done_fd;        // readable once a poller has seen everything consumed
+
+// mx held
+void push(long long sent) {
+	ring[(head + count++) % MAX_ITEMS] = sent;
+}
+
+// mx held
+void pop() {
+	bench_latency(bench_now() - ring[head]);
+	head = (head + 1) % MAX_ITEMS;
+	count--;
+}
+
+void* producer(void* v) {
+	for (int i = 0; i < NUM_ITEMS; i++) {
+		if (COND) {
+			uthread_mutex_lock(mx);
+			while (count == MAX_ITEMS)
+				uthread_cond_wait(not_full);
+			push(bench_now());
+			poll_cond_signal(not_empty);
+			uthread_mutex_unlock(mx);
+		}
+		else {
+			fast_sem_wait(space);
+			uthread_mutex_lock(mx);
+			push(bench_now());
+			uthread_mutex_unlock(mx);
+			fast_sem_signal(items_available);
+		}
+	}
+	return NULL;
+}
+
+void* writer(void* v) {
+	char* m = calloc(1, MESSAGE_SIZE);
+	for (int i = 0; i < NUM_MESSAGES; i++) {
+		long long sent = bench_now();
+		memcpy(m, &sent, sizeof(sent));
+		if (write(pipe_fds[1], m, MESSAGE_SIZE) != MESSAGE_SIZE) {
+			perror("write");
+			exit(1);
+		}
+	}
+	close(pipe_fds[1]);
+	return NULL;
+}
+
+// Takes every item there is without waiting, up to max; returns how many.
+int take_items(int max) {
+	int n = 0;
+	if (COND) {
+		uthread_mutex_lock(mx);
+		for (; n < max && count > 0; n++) {
+			pop();
+			uthread_cond_signal(not_full);
+		}
+		uthread_mutex_unlock(mx);
+	}
+	else
+		for (; n < max && fast_sem_trywait(items_available); n++) {
+			uthread_mutex_lock(mx);
+			pop();
+			uthread_mutex_unlock(mx);
+			fast_sem_signal(space);
+		}
+	return n;
+}
+
+// Blocking.
+void take_item() {
+	if (COND) {
+		uthread_mutex_lock(mx);
+		while (count == 0)
+			poll_cond_wait(not_empty);
+		pop();
+		uthread_cond_signal(not_full);
+		uthread_mutex_unlock(mx);
+	}
+	else {
+		fast_sem_wait(items_available);
+		uthread_mutex_lock(mx);
+		pop();
+		uthread_mutex_unlock(mx);
+		fast_sem_signal(space);
+	}
+}
+
+// Before polling the buffer's fd.  Returns 1 if there turned out to be an
+// item after all, which it has then taken, and 0 if it is armed; then *armed
+// is for disarm_buffer.
+int arm_buffer(long* armed) {
+	if (COND) {
+		uthread_mutex_lock(mx);
+		int ready = count > 0;
+		if (ready) {
+			pop();
+			uthread_cond_signal(not_full);
+		}
+		else
+			*armed = poll_cond_arm(not_empty);
+		uthread_mutex_unlock(mx);
+		return ready;
+	}
+	if (!fast_sem_arm(items_available))
+		return 0;
+	uthread_mutex_lock(mx);
+	pop();
+	uthread_mutex_unlock(mx);
+	fast_sem_signal(space);
+	return 1;
+}
+
+// After polling with the buffer armed, whatever woke the poller.
+void disarm_buffer(long armed) {
+	if (COND) {
+		uthread_mutex_lock(mx);
+		poll_cond_drain(not_empty, armed);
+		uthread_mutex_unlock(mx);
+	}
+	else
+		fast_sem_drain(items_available);
+}
+
+// Reads one message; returns 1, or 0 if there is none yet, or -1 at the end of the pipe.
+int read_message(char* m) {
+	int n = 0;
+	while (n < MESSAGE_SIZE) {
+		int r = read(pipe_fds[0], m + n, MESSAGE_SIZE - n);
+		if (r > 0)
+			n += r;
+		else if (r == 0)
+			return -1;
+		else if (errno == EAGAIN && n == 0)
+			return 0;
+		else if (errno != EAGAIN && errno != EINTR) {
+			perror("read");
+			exit(1);
+		}
+	}
+	long long sent;
+	memcpy(&sent, m, sizeof(sent));
+	bench_latency(bench_now() - sent);
+	return 1;
+}
+
+// Reads every message there is without waiting; returns how many.
+int take_messages(char* m) {
+	int n = 0;
+	uthread_mutex_lock(pipe_mx);
+	while (__atomic_load_n(&messages_left, __ATOMIC_RELAXED) > 0) {
+		int r = read_message(m);
+		if (r == 0)
+			break;
+		if (r < 0) {
+			fprintf(stderr, "pipe ended early\n");
+			exit(1);
+		}
+		__atomic_fetch_sub(&messages_left, 1, __ATOMIC_RELAXED);
+		n++;
+	}
+	uthread_mutex_unlock(pipe_mx);
+	return n;
+}
+
+// poll=1: everything in one thread, or num_pollers of them
+void* poll_consumer(void* v) {
+	char* m = malloc(MESSAGE_SIZE);
+	int buffer_fd = COND ? poll_cond_fd(not_empty) : fast_sem_fd(items_available);
+	int pipe_polled = 1;
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event e = { .events = EPOLLIN };
+	e.data.fd = pipe_fds[0];
+	epoll_ctl(ep, EPOLL_CTL_ADD, pipe_fds[0], &e);
+	e.data.fd = buffer_fd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, buffer_fd, &e);
+	e.data.fd = done_fd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, done_fd, &e);
+
+	while (__atomic_load_n(&items_left, __ATOMIC_RELAXED) > 0 || __atomic_load_n(&messages_left, __ATOMIC_RELAXED) > 0) {
+		int got = take_items(__atomic_load_n(&items_left, __ATOMIC_RELAXED));
+		__atomic_fetch_sub(&items_left, got, __ATOMIC_RELAXED);
+		got += take_messages(m);
+		if (got)
+			continue;
+		long armed = 0;
+		int buffer_armed = 0;
+		if (__atomic_load_n(&items_left, __ATOMIC_RELAXED) > 0) {
+			if (arm_buffer(&armed)) {
+				__atomic_fetch_sub(&items_left, 1, __ATOMIC_RELAXED);
+				continue;
+			}
+			buffer_armed = 1;
+		}
+
+		// nothing to do; the fds of whatever is done are readable for good, so stop polling them
+		if (__atomic_load_n(&messages_left, __ATOMIC_RELAXED) == 0 && pipe_polled) {
+			epoll_ctl(ep, EPOLL_CTL_DEL, pipe_fds[0], NULL);
+			pipe_polled = 0;
+		}
+		if (!buffer_armed && buffer_fd >= 0) {
+			epoll_ctl(ep, EPOLL_CTL_DEL, buffer_fd, NULL);
+			buffer_fd = -1;
+		}
+		struct epoll_event ready[3];
+		int n = epoll_wait(ep, ready, 3, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		if (buffer_armed)
+			disarm_buffer(armed);
+	}
+	// the other pollers may be waiting for what this one took last
+	uint64_t one = 1;
+	(void) !write(done_fd, &one, sizeof(one));
+	close(ep);
+	free(m);
+	return NULL;
+}
+
+// poll=0: one thread for the buffer ...
+void* buffer_consumer(void* v) {
+	for (int i = 0; i < NUM_PRODUCERS * NUM_ITEMS; i++)
+		take_item();
+	return NULL;
+}
+
+// ... and one for the pipe
+void* pipe_consumer(void* v) {
+	char* m = malloc(MESSAGE_SIZE);
+	for (int i = 0; i < NUM_MESSAGES; i++)
+		if (read_message(m) != 1) {
+			fprintf(stderr, "pipe ended early\n");
+			exit(1);
+		}
+	close(pipe_fds[0]);
+	free(m);
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	bench_init(argc, argv, params);
+	uthread_init(NUM_PROCESSORS);
+	mx = uthread_mutex_create();
+	ring = malloc(MAX_ITEMS * sizeof(long long));
+	space = fast_sem_create(MAX_ITEMS);
+	items_available = fast_sem_create_pollable(0);
+	not_empty = poll_cond_create(mx);
+	not_full = uthread_cond_create(mx);
+	if (pipe(pipe_fds) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	if (POLL)
+		fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+	items_left = NUM_PRODUCERS * NUM_ITEMS;
+	messages_left = NUM_MESSAGES;
+	pipe_mx = uthread_mutex_create();
+	done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	long ops = (long) NUM_PRODUCERS * NUM_ITEMS + NUM_MESSAGES;
+	bench_start(ops);
+	uthread_t consumers[POLL ? NUM_POLLERS : 2];
+	int num_consumers = 0;
+	if (POLL)
+		while (num_consumers < NUM_POLLERS)
+			consumers[num_consumers++] = uthread_create(poll_consumer, NULL);
+	else {
+		consumers[num_consumers++] = uthread_create(buffer_consumer, NULL);
+		consumers[num_consumers++] = uthread_create(pipe_consumer, NULL);
+	}
+	uthread_t producers[NUM_PRODUCERS];
+	for (int i = 0; i < NUM_PRODUCERS; i++)
+		producers[i] = uthread_create(producer, NULL);
+	uthread_t w = uthread_create(writer, NULL);
+
+	for (int i = 0; i < NUM_PRODUCERS; i++)
+		uthread_join(producers[i], NULL);
+	uthread_join(w, NULL);
+	for (int i = 0; i < num_consumers; i++)
+		uthread_join(consumers[i], NULL);
+	bench_stop();
+	if (POLL)
+		close(pipe_fds[0]);
+	close(done_fd);
+
+	printf("%s, %s: %d items and %d messages, %.0f per second\n",
+		!POLL ? "a consumer each" : NUM_POLLERS == 1 ? "one consumer in epoll" : "consumers in epoll",
+		COND ? "condition variable" : "semaphores",
+		NUM_PRODUCERS * NUM_ITEMS, NUM_MESSAGES, ops / (bench_elapsed_ns / 1e9));
+	bench_report(argv[0], ops);
+}
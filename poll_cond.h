@@ -0,0 +1,113 @@
+#ifndef POLL_COND_H
+#define POLL_COND_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "uthread.h"
+#include "uthread_mutex_cond.h"
+
+/**
+ * Condition variable that can also be waited for with poll/epoll, on
+ * poll_cond_fd, alongside file descriptors.  A poller cannot give up the
+ * mutex inside epoll_wait, so it arms the condition before unlocking instead:
+ *
+ *   lock
+ *   while (!ready) {
+ *     long armed = poll_cond_arm(c);
+ *     unlock
+ *     epoll_wait(...);          // poll_cond_fd(c) is one of the fds
+ *     lock
+ *     poll_cond_drain(c, armed);  // whichever fd woke it
+ *   }
+ *
+ * Signals and broadcasts wake threads blocked in poll_cond_wait as usual and,
+ * if a poller is armed, also make the fd readable.  The state is only used
+ * with the mutex held, so a signal cannot slip in between the check and the
+ * arm.
+ *
+ * Any number of threads can poll the same condition.  The fd stays readable
+ * until every poller that was armed at a signal has drained, so one of them
+ * cannot take the wake-up away from the others.  A poller that arms meanwhile
+ * finds it readable straight away, checks and arms again until then.
+ */
+
+struct poll_cond {
+	uthread_cond_t cond;
+	long           notifies;  // signals and broadcasts so far
+	int            armed;     // pollers armed since the last notify
+	int            notified;  // pollers armed at a notify that have not drained
+	int            efd;
+};
+
+typedef struct poll_cond* poll_cond_t;
+
+poll_cond_t poll_cond_create(uthread_mutex_t mutex) {
+	poll_cond_t c = malloc(sizeof(struct poll_cond));
+	c->cond = uthread_cond_create(mutex);
+	c->notifies = 0;
+	c->armed = 0;
+	c->notified = 0;
+	c->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return c;
+}
+
+void poll_cond_destroy(poll_cond_t c) {
+	close(c->efd);
+	uthread_cond_destroy(c->cond);
+	free(c);
+}
+
+// mutex held
+void poll_cond_wait(poll_cond_t c) {
+	uthread_cond_wait(c->cond);
+}
+
+// mutex held
+static void poll_cond_notify(poll_cond_t c) {
+	c->notifies++;
+	if (c->armed) {
+		uint64_t one = 1;
+		c->notified += c->armed;
+		c->armed = 0;
+		(void) !write(c->efd, &one, sizeof(one));
+	}
+}
+
+// mutex held
+void poll_cond_signal(poll_cond_t c) {
+	uthread_cond_signal(c->cond);
+	poll_cond_notify(c);
+}
+
+// mutex held
+void poll_cond_broadcast(poll_cond_t c) {
+	uthread_cond_broadcast(c->cond);
+	poll_cond_notify(c);
+}
+
+int poll_cond_fd(poll_cond_t c) {
+	return c->efd;
+}
+
+// mutex held; the fd becomes readable at the next signal or broadcast.
+// Returns what to give poll_cond_drain.
+long poll_cond_arm(poll_cond_t c) {
+	c->armed++;
+	return c->notifies;
+}
+
+// mutex held; after every poll that followed poll_cond_arm, whether or not
+// poll_cond_fd was readable, before checking again.  armed is what
+// poll_cond_arm returned.
+void poll_cond_drain(poll_cond_t c, long armed) {
+	if (armed == c->notifies)
+		c->armed--;  // not notified yet
+	else if (--c->notified == 0) {
+		uint64_t n;
+		(void) !read(c->efd, &n, sizeof(n));
+	}
+}
+
+#endif
@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "uthread.h"
+#include "uthread_sem.h"
+#include "fast_sem.h"
+#include "bench.h"
+
+/**
+ * Semaphore microbenchmark: uthread_sem against fast_sem (see fast_sem.h).
+ *
+ * Each of num_threads threads does num_iterations wait/signal pairs on one
+ * semaphore used as a mutex.  With num_threads=1 no operation ever has to
+ * wait; with more threads than num_processors they contend for it.
+ */
+
+// defaults, each can be changed on the command line (see bench.h)
+int NUM_ITERATIONS = 1000000;
+int NUM_THREADS    = 1;
+int NUM_PROCESSORS = 1;
+int FAST           = 1;  // 0: uthread_sem, 1: fast_sem
+
+struct Param params[] = {
+	{ "num_iterations", &NUM_ITERATIONS, 1 },
+	{ "num_threads",    &NUM_THREADS,    1 },
+	{ "num_processors", &NUM_PROCESSORS, 1 },
+	{ "fast",           &FAST },
+	{ NULL, NULL }
+};
+
+uthread_sem_t slow;
+fast_sem_t    fast;
+long          in_critical_section;  // only changed while holding the semaphore
+
+void* slow_worker(void* v) {
+	for (int i = 0; i < NUM_ITERATIONS; i++) {
+		uthread_sem_wait(slow);
+		in_critical_section++;
+		uthread_sem_signal(slow);
+	}
+	return NULL;
+}
+
+void* fast_worker(void* v) {
+	for (int i = 0; i < NUM_ITERATIONS; i++) {
+		fast_sem_wait(fast);
+		in_critical_section++;
+		fast_sem_signal(fast);
+	}
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	bench_init(argc, argv, params);
+	uthread_init(NUM_PROCESSORS);
+	slow = uthread_sem_create(1);
+	fast = fast_sem_create(1);
+
+	uthread_t threads[NUM_THREADS];
+	bench_start(0);
+	for (int i = 0; i < NUM_THREADS; i++)
+		threads[i] = uthread_create(FAST ? fast_worker : slow_worker, NULL);
+	for (int i = 0; i < NUM_THREADS; i++)
+		uthread_join(threads[i], NULL);
+	bench_stop();
+
+	long ops = (long) NUM_THREADS * NUM_ITERATIONS;
+	if (in_critical_section != ops) {
+		fprintf(stderr, "lost updates: %ld of %ld\n", in_critical_section, ops);
+		return 1;
+	}
+	printf("%s: %ld wait/signal pairs, %.0f per second\n", FAST ? "fast_sem" : "uthread_sem",
+		ops, ops / (bench_elapsed_ns / 1e9));
+	bench_report(argv[0], ops);
+}
@@ -5,8 +5,22 @@
 #include <unistd.h>
 #include "uthread.h"
 #include "uthread_mutex_cond.h"
-
-#define NUM_ITERATIONS 1000
+#include "lockprof.h"
+#include "trace.h"
+#include "bench.h"
+#include "metrics.h"
+
+// defaults, each can be changed on the command line (see bench.h)
+int NUM_ITERATIONS = 1000;  // per agent
+int NUM_AGENTS     = 1;
+int NUM_SMOKERS    = 1;     // of each kind
+
+struct Param params[] = {
+	{ "num_iterations", &NUM_ITERATIONS, 1 },
+	{ "num_agents",     &NUM_AGENTS,     1 },
+	{ "num_smokers",    &NUM_SMOKERS,    1 },
+	{ NULL, NULL }
+};
 
 #ifdef VERBOSE
 #define VERBOSE_PRINT(S, ...) printf (S, ##__VA_ARGS__);
@@ -14,12 +28,27 @@
 #define VERBOSE_PRINT(S, ...) ;
 #endif
 
+/**
+ * Every agent has its own helpers and coordinator, all on the agent's mutex,
+ * so agents never wait for each other.  Smokers are shared: each kind has a
+ * pool with its own mutex, and a coordinator that has matched two resources
+ * hands its agent to the pool of the smoker that needs them.  Whichever smoker
+ * of that kind is idle takes it, smokes, and tells that agent.
+ */
 struct Agent {
 	uthread_mutex_t mutex;
 	uthread_cond_t  match;
 	uthread_cond_t  paper;
 	uthread_cond_t  tobacco;
 	uthread_cond_t  smoke;
+	uthread_cond_t  kira_yamato;  // the coordinator
+	int             resource[5];  // used by helpers and the coordinator
+	int             waiters[5];   // blocked on match, paper and tobacco, by resource
+	int             smoke_waiters;
+	int             coordinator_waiters;
+#ifdef LOCK_PROFILE
+	struct LockProf* prof;
+#endif
 };
 
 struct Agent* createAgent() {
@@ -29,9 +58,70 @@ struct Agent* createAgent() {
 	agent->match = uthread_cond_create(agent->mutex);
 	agent->tobacco = uthread_cond_create(agent->mutex);
 	agent->smoke = uthread_cond_create(agent->mutex);
+	agent->kira_yamato = uthread_cond_create(agent->mutex);
+	for (int i = 0; i < 5; i++)
+		agent->resource[i] = agent->waiters[i] = 0;
+	agent->smoke_waiters = agent->coordinator_waiters = 0;
+#ifdef LOCK_PROFILE
+	agent->prof = lockprof_create("agent->mutex");
+#endif
 	return agent;
 }
 
+// Agents waiting for a smoker of one kind.  Each agent has at most one
+// smoker in flight, so the queue never holds more than NUM_AGENTS.
+struct Pool {
+	uthread_mutex_t mutex;
+	uthread_cond_t  waiting;  // queue is not empty
+	int             waiters;  // blocked on waiting
+	struct Agent**  queue;
+	int             head;
+	int             length;
+#ifdef LOCK_PROFILE
+	struct LockProf* prof;
+#endif
+};
+
+struct Pool* createPool() {
+	struct Pool* pool = malloc(sizeof(struct Pool));
+	pool->mutex = uthread_mutex_create();
+	pool->waiting = uthread_cond_create(pool->mutex);
+	pool->queue = malloc(NUM_AGENTS * sizeof(struct Agent*));
+	pool->head = 0;
+	pool->length = 0;
+	pool->waiters = 0;
+#ifdef LOCK_PROFILE
+	pool->prof = lockprof_create("pool->mutex");
+#endif
+	return pool;
+}
+
+LOCKPROF_WRAPPER void lock(struct Agent * agent) {
+	LOCKPROF_LOCK(agent->prof, uthread_mutex_lock(agent->mutex));
+}
+
+LOCKPROF_WRAPPER void unlock(struct Agent * agent) {
+	LOCKPROF_UNLOCK(agent->prof, uthread_mutex_unlock(agent->mutex));
+}
+
+// c must be one of the conds on agent's mutex, and *waiters its count of waiters
+LOCKPROF_WRAPPER void cond_wait(uthread_cond_t c, int * waiters, struct Agent * agent) {
+	(*waiters)++;
+	TRACE_EVENT(TRACE_COND_WAIT_BEGIN, c);
+	LOCKPROF_COND_WAIT(agent->prof, uthread_cond_wait(c));
+	TRACE_EVENT(TRACE_COND_WAIT_END, c);
+}
+
+// Holding c's mutex; *waiters is c's count of waiters.
+void cond_signal(uthread_cond_t c, int * waiters) {
+	TRACE_EVENT(TRACE_COND_SIGNAL, c);
+	if (*waiters > 0) {
+		(*waiters)--;
+		bench_wakeup(1);
+	}
+	uthread_cond_signal(c);
+}
+
 //
 // TODO
 // You will probably need to add some procedures and struct etc.
@@ -45,8 +135,10 @@ struct Agent* createAgent() {
 enum Resource { MATCH = 1, PAPER = 2, TOBACCO = 4 };
 char* resource_name[] = { "", "match",   "paper", "", "tobacco" };
 
-int signal_count[5];  // # of times resource signalled
-int smoke_count[5];  // # of times smoker with resource smoked
+int signal_count[5];  // # of times resource signalled, atomic
+int smoke_count[5];  // # of times smoker with resource smoked, under pools[resource]->mutex
+
+struct Pool* pools[5];  // by the resource the smoker has
 
 /**
  * This is the agent procedure.  It is complete and you shouldn't change it in
@@ -59,55 +151,57 @@ void* agent(void* av) {
 	static const int choices[] = { MATCH | PAPER, MATCH | TOBACCO, PAPER | TOBACCO };
 	static const int matching_smoker[] = { TOBACCO,     PAPER,         MATCH };
 
-	uthread_mutex_lock(a->mutex);
+	lock(a);
 	for (int i = 0; i < NUM_ITERATIONS; i++) {
+		long long start = bench_now();
 		int r = random() % 3;
-		signal_count[matching_smoker[r]] ++;
+		__atomic_fetch_add(&signal_count[matching_smoker[r]], 1, __ATOMIC_RELAXED);
 		int c = choices[r];
 		if (c & MATCH) {
 			VERBOSE_PRINT("match available\n");
-			uthread_cond_signal(a->match);
+			TRACE_EVENT(TRACE_RESOURCE, MATCH);
+			cond_signal(a->match, &a->waiters[MATCH]);
 		}
 		if (c & PAPER) {
 			VERBOSE_PRINT("paper available\n");
-			uthread_cond_signal(a->paper);
+			TRACE_EVENT(TRACE_RESOURCE, PAPER);
+			cond_signal(a->paper, &a->waiters[PAPER]);
 		}
 		if (c & TOBACCO) {
 			VERBOSE_PRINT("tobacco available\n");
-			uthread_cond_signal(a->tobacco);
+			TRACE_EVENT(TRACE_RESOURCE, TOBACCO);
+			cond_signal(a->tobacco, &a->waiters[TOBACCO]);
 		}
 		VERBOSE_PRINT("agent is waiting for smoker to smoke\n");
-		uthread_cond_wait(a->smoke);
+		cond_wait(a->smoke, &a->smoke_waiters, a);
+		bench_latency(bench_now() - start);
 	}
-	uthread_mutex_unlock(a->mutex);
+	unlock(a);
 	return NULL;
 }
 
-void lock(struct Agent * agent) {
-	uthread_mutex_lock(agent->mutex);
+LOCKPROF_WRAPPER void lock_pool(struct Pool * pool) {
+	LOCKPROF_LOCK(pool->prof, uthread_mutex_lock(pool->mutex));
 }
 
-void unlock(struct Agent * agent) {
-	uthread_mutex_unlock(agent->mutex);
+LOCKPROF_WRAPPER void unlock_pool(struct Pool * pool) {
+	LOCKPROF_UNLOCK(pool->prof, uthread_mutex_unlock(pool->mutex));
 }
 
-uthread_cond_t t_cond;
-uthread_cond_t p_cond;
-uthread_cond_t m_cond;
-uthread_cond_t kira_yamato;
-
-// used by helpers and the ultimate coordinator kira yamato
-int resource[] = { 0, 0, 0, 0, 0 };
+LOCKPROF_WRAPPER void pool_wait(struct Pool * pool) {
+	pool->waiters++;
+	TRACE_EVENT(TRACE_COND_WAIT_BEGIN, pool->waiting);
+	LOCKPROF_COND_WAIT(pool->prof, uthread_cond_wait(pool->waiting));
+	TRACE_EVENT(TRACE_COND_WAIT_END, pool->waiting);
+}
 
-uthread_cond_t get_smoker_cond(int resource) {
-	switch (resource) {
-	case TOBACCO:
-		return t_cond;
-	case PAPER:
-		return p_cond;
-	case MATCH:
-		return m_cond;
-	}
+// Called by a's coordinator, holding a's mutex.
+void call_smoker(int resource, struct Agent * a) {
+	struct Pool* pool = pools[resource];
+	lock_pool(pool);
+	pool->queue[(pool->head + pool->length++) % NUM_AGENTS] = a;
+	cond_signal(pool->waiting, &pool->waiters);
+	unlock_pool(pool);
 }
 
 void debug_smoker_smoked(int smoker) {
@@ -124,34 +218,44 @@ void debug_smoker_smoked(int smoker) {
 	}
 }
 
-// whole thing happens while holding agent's mutex
-void smoke(int resource, struct Agent * a) {
+// holding the pool's mutex
+void smoke(int resource) {
 	//debug_smoker_smoked(resource);
 	smoke_count[resource]++;
-	uthread_cond_signal(a->smoke);
+	TRACE_EVENT(TRACE_SMOKE, resource);
 }
 
-void smoker(int resource, struct Agent * a) {
-	lock(a);
+void smoker(int resource) {
+	struct Pool* pool = pools[resource];
 	while (1) {
-		uthread_cond_wait(get_smoker_cond(resource));
-		smoke(resource, a);
+		lock_pool(pool);
+		while (pool->length == 0)
+			pool_wait(pool);
+		struct Agent* a = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % NUM_AGENTS;
+		pool->length--;
+		smoke(resource);
+		unlock_pool(pool);
+
+		// a's agent is waiting for this; it holds a's mutex until it does
+		lock(a);
+		cond_signal(a->smoke, &a->smoke_waiters);
+		unlock(a);
 	}
-	unlock(a);
 }
 
-void * tobacco(void * agent) {
-	smoker(TOBACCO, (struct Agent*) agent);
+void * tobacco(void * v) {
+	smoker(TOBACCO);
 	return NULL;
 }
 
-void * match(void * agent) {
-	smoker(MATCH, (struct Agent*) agent);
+void * match(void * v) {
+	smoker(MATCH);
 	return NULL;
 }
 
-void * paper(void * agent) {
-	smoker(PAPER, (struct Agent*) agent);
+void * paper(void * v) {
+	smoker(PAPER);
 	return NULL;
 }
 
@@ -195,9 +299,9 @@ void helper(int r, struct Agent * a) {
 	uthread_cond_t c = get_resource_cond(r, a);
 	lock(a);
 	while (1) {
-		uthread_cond_wait(c);
-		resource[r] = 1;
-		uthread_cond_signal(kira_yamato);
+		cond_wait(c, &a->waiters[r], a);
+		a->resource[r] = 1;
+		cond_signal(a->kira_yamato, &a->coordinator_waiters);
 	}
 	unlock(a);
 }
@@ -217,60 +321,83 @@ void * paper_helper(void * agent) {
 	return NULL;
 }
 
-void SEED_mode(){
+void SEED_mode(struct Agent * a){
+	int* resource = a->resource;
 	if (resource[TOBACCO] == 1 && resource[PAPER] == 1){
 		resource[TOBACCO] = 0;
 		resource[PAPER] = 0;
-		uthread_cond_signal(get_smoker_cond(MATCH));
+		call_smoker(MATCH, a);
 	} else if (resource[PAPER] == 1 && resource[MATCH] == 1) {
 		resource[PAPER] = 0;
 		resource[MATCH] = 0;
-		uthread_cond_signal(get_smoker_cond(TOBACCO));
+		call_smoker(TOBACCO, a);
 	} else {
 		resource[TOBACCO] = 0;
 		resource[MATCH] = 0;
-		uthread_cond_signal(get_smoker_cond(PAPER));
+		call_smoker(PAPER, a);
 	}
 }
 
-void* ultimate_coordinator(void * a) {
+void* ultimate_coordinator(void * av) {
+	struct Agent* a = av;
 	lock(a);
 	while (1) {
-		while (resource[TOBACCO] + resource[MATCH] + resource[PAPER] < 2) {
-			uthread_cond_wait(kira_yamato);
+		while (a->resource[TOBACCO] + a->resource[MATCH] + a->resource[PAPER] < 2) {
+			cond_wait(a->kira_yamato, &a->coordinator_waiters, a);
 		}
 		// Got enough resources to signal a smoker
-		SEED_mode();
+		SEED_mode(a);
 	}
 	unlock(a);
 	return NULL;
 }
 
 int main(int argc, char** argv) {
+	bench_init(argc, argv, params);
 	uthread_init(8);
-	struct Agent*  a = createAgent();
+	struct Agent*  a[NUM_AGENTS];
+	uthread_t      agents[NUM_AGENTS];
 
-	t_cond = uthread_cond_create(a->mutex);
-	p_cond = uthread_cond_create(a->mutex);
-	m_cond = uthread_cond_create(a->mutex);
-	kira_yamato = uthread_cond_create(a->mutex);
+	pools[MATCH] = createPool();
+	pools[PAPER] = createPool();
+	pools[TOBACCO] = createPool();
 
-	uthread_create(tobacco_helper, a);
-	uthread_create(paper_helper, a);
-	uthread_create(match_helper, a);
+	for (int i = 0; i < NUM_AGENTS; i++) {
+		a[i] = createAgent();
+		uthread_create(tobacco_helper, a[i]);
+		uthread_create(paper_helper, a[i]);
+		uthread_create(match_helper, a[i]);
 
-	uthread_create(ultimate_coordinator, a);
+		uthread_create(ultimate_coordinator, a[i]);
+	}
 
-	uthread_create(tobacco, a);
-	uthread_create(paper, a);
-	uthread_create(match, a);
+	for (int i = 0; i < NUM_SMOKERS; i++) {
+		uthread_create(tobacco, NULL);
+		uthread_create(paper, NULL);
+		uthread_create(match, NULL);
+	}
 
 	// TODO
-	uthread_join(uthread_create(agent, a), 0);
+	bench_start(NUM_AGENTS * NUM_ITERATIONS);
+	metrics_int("signal_count[match]", &signal_count[MATCH]);
+	metrics_int("signal_count[paper]", &signal_count[PAPER]);
+	metrics_int("signal_count[tobacco]", &signal_count[TOBACCO]);
+	metrics_int("smoke_count[match]", &smoke_count[MATCH]);
+	metrics_int("smoke_count[paper]", &smoke_count[PAPER]);
+	metrics_int("smoke_count[tobacco]", &smoke_count[TOBACCO]);
+	metrics_start(argv[0]);
+	for (int i = 0; i < NUM_AGENTS; i++)
+		agents[i] = uthread_create(agent, a[i]);
+	for (int i = 0; i < NUM_AGENTS; i++)
+		uthread_join(agents[i], 0);
+	bench_stop();
 	assert(signal_count[MATCH] == smoke_count[MATCH]);
 	assert(signal_count[PAPER] == smoke_count[PAPER]);
 	assert(signal_count[TOBACCO] == smoke_count[TOBACCO]);
-	assert(smoke_count[MATCH] + smoke_count[PAPER] + smoke_count[TOBACCO] == NUM_ITERATIONS);
+	assert(smoke_count[MATCH] + smoke_count[PAPER] + smoke_count[TOBACCO] == NUM_AGENTS * NUM_ITERATIONS);
 	printf("Smoke counts: %d matches, %d paper, %d tobacco\n",
 		smoke_count[MATCH], smoke_count[PAPER], smoke_count[TOBACCO]);
+	printf("%d agents, %d smokers of each kind: %.0f smokes per second\n", NUM_AGENTS, NUM_SMOKERS,
+		NUM_AGENTS * NUM_ITERATIONS / (bench_elapsed_ns / 1e9));
+	bench_report(argv[0], NUM_AGENTS * NUM_ITERATIONS);
 }
\ No newline at end of file
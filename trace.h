@@ -0,0 +1,126 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/**
+ * Binary event tracing.
+ *
+ * Build with -DTRACE to record synchronization events as fixed-size binary
+ * records instead of printing them.  Each processor (carrier thread) appends to
+ * its own ring buffer, so recording takes no locks; when a ring is full the
+ * oldest records are overwritten.  The rings are written to $TRACE_FILE
+ * (default trace.bin) at exit; convert that with trace2json to load it in a
+ * Chrome trace viewer (chrome://tracing or ui.perfetto.dev).
+ *
+ * Without TRACE, TRACE_EVENT expands to nothing.
+ */
+
+#define TRACE_MAGIC   0x31435254434e5953ULL  // "SYNCTRC1"
+
+enum TraceEvent {
+	TRACE_ENTER,            // admitted to the well (arg: endianness)
+	TRACE_LEAVE,            // left the well
+	TRACE_COND_WAIT_BEGIN,  // arg: condition
+	TRACE_COND_WAIT_END,
+	TRACE_COND_SIGNAL,
+	TRACE_COND_BROADCAST,
+	TRACE_SEM_WAIT_BEGIN,   // arg: semaphore
+	TRACE_SEM_WAIT_END,
+	TRACE_SEM_SIGNAL,
+	TRACE_RESOURCE,         // agent made a resource available (arg: resource)
+	TRACE_SMOKE,            // arg: resource of the smoker
+	TRACE_NUM_EVENTS
+};
+
+struct TraceRecord {
+	uint64_t ts;     // CLOCK_MONOTONIC, ns
+	uint64_t tid;    // uthread_self() of the recording thread
+	uint32_t event;  // enum TraceEvent
+	uint32_t arg;
+};
+
+// file layout: header, then num_records records in no particular order
+struct TraceHeader {
+	uint64_t magic;
+	uint64_t num_records;
+};
+
+#ifdef TRACE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "uthread.h"
+
+#define TRACE_RING_SIZE  (1 << 16)  // records per processor, power of 2
+#define TRACE_MAX_RINGS  64
+
+struct TraceRing {
+	uint64_t           written;  // total records ever appended; only the owner writes it
+	struct TraceRecord records[TRACE_RING_SIZE];
+};
+
+struct TraceRing*         trace_rings[TRACE_MAX_RINGS];
+int                       trace_num_rings;
+static __thread struct TraceRing* trace_ring;  // this processor's ring
+
+static void trace_dump() {
+	const char* name = getenv("TRACE_FILE") ? getenv("TRACE_FILE") : "trace.bin";
+	FILE* f = fopen(name, "wb");
+	if (f == NULL) {
+		perror(name);
+		return;
+	}
+	int n = __atomic_load_n(&trace_num_rings, __ATOMIC_ACQUIRE);
+	if (n > TRACE_MAX_RINGS)
+		n = TRACE_MAX_RINGS;
+	uint64_t written[TRACE_MAX_RINGS];
+	struct TraceHeader h = { TRACE_MAGIC, 0 };
+	for (int i = 0; i < n; i++) {
+		written[i] = trace_rings[i] ? __atomic_load_n(&trace_rings[i]->written, __ATOMIC_ACQUIRE) : 0;
+		h.num_records += written[i] < TRACE_RING_SIZE ? written[i] : TRACE_RING_SIZE;
+	}
+	fwrite(&h, sizeof(h), 1, f);
+	for (int i = 0; i < n; i++) {
+		uint64_t count = written[i] < TRACE_RING_SIZE ? written[i] : TRACE_RING_SIZE;
+		for (uint64_t j = written[i] - count; j < written[i]; j++)
+			fwrite(&trace_rings[i]->records[j & (TRACE_RING_SIZE - 1)], sizeof(struct TraceRecord), 1, f);
+	}
+	fclose(f);
+	fprintf(stderr, "trace: %llu records written to %s\n", (unsigned long long) h.num_records, name);
+}
+
+static struct TraceRing* trace_ring_create() {
+	struct TraceRing* r = calloc(1, sizeof(struct TraceRing));
+	int i = __atomic_fetch_add(&trace_num_rings, 1, __ATOMIC_ACQ_REL);
+	if (i == 0)
+		atexit(trace_dump);
+	if (i < TRACE_MAX_RINGS)
+		__atomic_store_n(&trace_rings[i], r, __ATOMIC_RELEASE);
+	return r;
+}
+
+static void trace_record(enum TraceEvent event, uint32_t arg) {
+	struct timespec t;
+	struct TraceRing* r = trace_ring;
+	if (r == NULL)
+		r = trace_ring = trace_ring_create();
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	struct TraceRecord* rec = &r->records[r->written & (TRACE_RING_SIZE - 1)];
+	rec->ts = t.tv_sec * 1000000000ULL + t.tv_nsec;
+	rec->tid = (uintptr_t) uthread_self();
+	rec->event = event;
+	rec->arg = arg;
+	__atomic_store_n(&r->written, r->written + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_EVENT(event, arg) trace_record(event, (uint32_t) (uintptr_t) (arg));
+
+#else
+
+#define TRACE_EVENT(event, arg) ;
+
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "trace.h"
+
+/**
+ * Convert a binary trace written by a -DTRACE build (see trace.h) to Chrome
+ * trace JSON.
+ *
+ *   trace2json trace.bin > trace.json
+ *
+ * Waits and time spent in the well become duration slices; signals,
+ * resources and smokes become instant events.  Thread ids are renumbered
+ * 1, 2, ... in order of first appearance.
+ */
+
+#define MAX_THREADS 4096
+
+// by enum TraceEvent
+const char* trace_event_name[] = {
+	"enter", "leave", "cond_wait", "cond_wait_end", "cond_signal", "cond_broadcast",
+	"sem_wait", "sem_wait_end", "sem_signal", "resource", "smoke"
+};
+
+uint64_t thread_ids[MAX_THREADS];
+int      num_threads;
+
+int thread_number(uint64_t tid) {
+	for (int i = 0; i < num_threads; i++)
+		if (thread_ids[i] == tid)
+			return i + 1;
+	if (num_threads == MAX_THREADS)
+		return 0;
+	thread_ids[num_threads++] = tid;
+	return num_threads;
+}
+
+int compare_ts(const void* a, const void* b) {
+	const struct TraceRecord* x = a;
+	const struct TraceRecord* y = b;
+	return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s trace.bin > trace.json\n", argv[0]);
+		return 1;
+	}
+	FILE* f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	struct TraceHeader h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a trace file\n", argv[1]);
+		return 1;
+	}
+	struct TraceRecord* records = malloc(h.num_records * sizeof(struct TraceRecord));
+	uint64_t n = fread(records, sizeof(struct TraceRecord), h.num_records, f);
+	fclose(f);
+	if (n != h.num_records)
+		fprintf(stderr, "%s: truncated, %llu of %llu records\n", argv[1],
+			(unsigned long long) n, (unsigned long long) h.num_records);
+
+	// each ring is in order, but the rings are not in order with each other
+	qsort(records, n, sizeof(struct TraceRecord), compare_ts);
+
+	printf("{\"traceEvents\":[\n");
+	int printed = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		struct TraceRecord* r = &records[i];
+		const char* name;
+		const char* phase;
+		if (r->event >= TRACE_NUM_EVENTS)
+			continue;
+		switch (r->event) {
+		case TRACE_ENTER:           name = "in well";   phase = "B"; break;
+		case TRACE_LEAVE:           name = "in well";   phase = "E"; break;
+		case TRACE_COND_WAIT_BEGIN: name = "cond_wait"; phase = "B"; break;
+		case TRACE_COND_WAIT_END:   name = "cond_wait"; phase = "E"; break;
+		case TRACE_SEM_WAIT_BEGIN:  name = "sem_wait";  phase = "B"; break;
+		case TRACE_SEM_WAIT_END:    name = "sem_wait";  phase = "E"; break;
+		default:                    name = trace_event_name[r->event]; phase = "i"; break;
+		}
+		printf("%s{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%d%s,\"args\":{\"arg\":%u}}",
+			printed++ ? ",\n" : "", name, phase, (r->ts - records[0].ts) / 1000.0, thread_number(r->tid),
+			phase[0] == 'i' ? ",\"s\":\"t\"" : "", r->arg);
+	}
+	printf("\n]}\n");
+	free(records);
+	return 0;
+}
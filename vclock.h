@@ -0,0 +1,187 @@
+#ifndef VCLOCK_H
+#define VCLOCK_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "uthread.h"
+#include "uthread_mutex_cond.h"
+
+/**
+ * Discrete virtual clock.
+ *
+ * Threads sleep in virtual time instead of spinning on uthread_yield.  The
+ * clock keeps count of the threads that are runnable; when that count drops to
+ * zero, every live thread is either sleeping or blocked, so time jumps straight
+ * to the earliest wake-up and that sleeper is made runnable.  A run therefore
+ * takes as long as its synchronization work, however long it is in virtual
+ * time.
+ *
+ * For this to work the clock has to know about every other way a thread can
+ * block.  Call vclock_block() just before blocking on anything that only another
+ * thread can release (a condition variable, a semaphore with no units) and have
+ * the thread that releases it call vclock_wake() for the threads it releases.
+ * Short waits for a mutex need no accounting, since the holder is runnable.
+ */
+
+enum Dist { CONSTANT, EXPONENTIAL, PARETO };
+const static char* dist_name[] = { "constant", "exponential", "pareto" };
+
+#define PARETO_ALPHA 1.5   // heavy tailed: finite mean, infinite variance
+
+struct VSleeper {
+	double         wake;   // virtual time to wake up at
+	long           seq;    // breaks ties between equal wake times in FIFO order
+	int            ready;  // set by the clock when it is this sleeper's turn
+	unsigned int   seed;   // for dist_sample
+	uthread_cond_t cond;
+};
+
+uthread_mutex_t   vclock_mx;
+double            vclock_now;
+long              vclock_seq;
+int               vclock_runnable;  // live threads that are neither sleeping nor blocked
+int               vclock_live;
+struct VSleeper** vclock_heap;      // min-heap on (wake, seq)
+int               vclock_heap_size;
+
+void vclock_init(int num_threads) {
+	vclock_mx = uthread_mutex_create();
+	vclock_now = 0;
+	vclock_seq = 0;
+	vclock_runnable = num_threads;
+	vclock_live = num_threads;
+	vclock_heap = malloc(num_threads * sizeof(struct VSleeper*));
+	vclock_heap_size = 0;
+}
+
+struct VSleeper* vclock_sleeper_create(unsigned int seed) {
+	struct VSleeper* s = malloc(sizeof(struct VSleeper));
+	s->ready = 0;
+	s->seed = seed;
+	s->cond = uthread_cond_create(vclock_mx);
+	return s;
+}
+
+double vclock_time() {
+	return vclock_now;
+}
+
+// Draw a duration with the given mean.
+double dist_sample(struct VSleeper* s, enum Dist d, double mean) {
+	double u = (rand_r(&s->seed) + 1.0) / ((double) RAND_MAX + 2.0);  // in (0, 1)
+	switch (d) {
+	case EXPONENTIAL:
+		return -mean * log(u);
+	case PARETO:
+		return mean * (PARETO_ALPHA - 1) / PARETO_ALPHA / pow(u, 1 / PARETO_ALPHA);
+	default:
+		return mean;
+	}
+}
+
+static int vclock_before(struct VSleeper* a, struct VSleeper* b) {
+	return a->wake < b->wake || (a->wake == b->wake && a->seq < b->seq);
+}
+
+static void vclock_push(struct VSleeper* s) {
+	int i = vclock_heap_size++;
+	while (i > 0 && vclock_before(s, vclock_heap[(i - 1) / 2])) {
+		vclock_heap[i] = vclock_heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	vclock_heap[i] = s;
+}
+
+static struct VSleeper* vclock_pop() {
+	struct VSleeper* top = vclock_heap[0];
+	struct VSleeper* last = vclock_heap[--vclock_heap_size];
+	int i = 0;
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= vclock_heap_size)
+			break;
+		if (c + 1 < vclock_heap_size && vclock_before(vclock_heap[c + 1], vclock_heap[c]))
+			c++;
+		if (!vclock_before(vclock_heap[c], last))
+			break;
+		vclock_heap[i] = vclock_heap[c];
+		i = c;
+	}
+	vclock_heap[i] = last;
+	return top;
+}
+
+// vclock_mx held.  Nobody can run, so move time forward to the next wake-up.
+static void vclock_advance() {
+	if (vclock_runnable > 0 || vclock_live == 0)
+		return;
+	if (vclock_heap_size == 0) {
+		fprintf(stderr, "vclock: all %d threads are blocked at time %f\n", vclock_live, vclock_now);
+		abort();
+	}
+	struct VSleeper* s = vclock_pop();
+	vclock_now = s->wake;
+	s->ready = 1;
+	vclock_runnable++;
+	uthread_cond_signal(s->cond);
+}
+
+// Sleep for duration units of virtual time.
+void vclock_sleep(struct VSleeper* s, double duration) {
+	uthread_mutex_lock(vclock_mx);
+	s->wake = vclock_now + duration;
+	s->seq = vclock_seq++;
+	vclock_push(s);
+	vclock_runnable--;
+	vclock_advance();
+	while (!s->ready)
+		uthread_cond_wait(s->cond);
+	s->ready = 0;
+	uthread_mutex_unlock(vclock_mx);
+}
+
+// The caller is about to block until another thread calls vclock_wake for it.
+void vclock_block() {
+	uthread_mutex_lock(vclock_mx);
+	vclock_runnable--;
+	vclock_advance();
+	uthread_mutex_unlock(vclock_mx);
+}
+
+// The caller has just released n threads that called vclock_block.
+void vclock_wake(int n) {
+	if (n == 0)
+		return;
+	uthread_mutex_lock(vclock_mx);
+	vclock_runnable += n;
+	uthread_mutex_unlock(vclock_mx);
+}
+
+// The caller is finished.
+void vclock_exit() {
+	uthread_mutex_lock(vclock_mx);
+	vclock_runnable--;
+	vclock_live--;
+	vclock_advance();
+	uthread_mutex_unlock(vclock_mx);
+}
+
+static int vclock_compare(const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+// Print mean and percentiles of n samples (sorts them in place).
+void vclock_print_latency(const char* what, double* samples, int n) {
+	double sum = 0;
+	if (n == 0)
+		return;
+	qsort(samples, n, sizeof(double), vclock_compare);
+	for (int i = 0; i < n; i++)
+		sum += samples[i];
+	printf("%s: mean %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n", what, sum / n,
+		samples[n / 2], samples[n * 90 / 100], samples[n * 99 / 100], samples[n - 1]);
+}
+
+#endif
@@ -4,8 +4,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdint.h>
+#include <string.h>
 #include "uthread.h"
 #include "uthread_mutex_cond.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "bench.h"
+#include "metrics.h"
 
 #ifdef VERBOSE
 #define VERBOSE_PRINT(S, ...) printf (S, ##__VA_ARGS__);
@@ -13,10 +19,56 @@
 #define VERBOSE_PRINT(S, ...) ;
 #endif
 
-#define MAX_OCCUPANCY      3
-#define NUM_ITERATIONS     100
-#define NUM_PEOPLE         20
-#define FAIR_WAITING_COUNT 4
+// defaults, each can be changed on the command line (see bench.h)
+int MAX_OCCUPANCY      = 3;
+int NUM_ITERATIONS     = 100;
+int NUM_PEOPLE         = 20;
+int FAIR_WAITING_COUNT = 4;
+int NUM_PROCESSORS     = 1;
+int NUM_YIELDS         = 0;   // spent drinking and again walking away; 0 for NUM_PEOPLE
+int NUM_PRIORITIES     = 1;   // drinker i has priority i % NUM_PRIORITIES, 0 the highest
+int STARVATION_BOUND   = 50;  // entries a waiter sees go by before it outranks every priority
+int SEED               = 0;   // for rand(), which picks each drinker's endianness; 0 seeds from the time
+int TIME_SCALE         = 100; // replay: percent of the trace's times, so 50 replays it twice as fast
+int REPLAY_QUEUE       = 64;  // replay: arrivals read ahead of the drinkers
+
+struct Param params[] = {
+	{ "max_occupancy",      &MAX_OCCUPANCY,      1 },
+	{ "num_iterations",     &NUM_ITERATIONS,     1 },
+	{ "num_people",         &NUM_PEOPLE,         1 },
+	{ "fair_waiting_count", &FAIR_WAITING_COUNT, 1 },
+	{ "num_processors",     &NUM_PROCESSORS,     1 },
+	{ "num_yields",         &NUM_YIELDS },
+	{ "num_priorities",     &NUM_PRIORITIES,     1 },
+	{ "starvation_bound",   &STARVATION_BOUND },
+	{ "seed",               &SEED },
+	{ "time_scale",         &TIME_SCALE },
+	{ "replay_queue",       &REPLAY_QUEUE,       1 },
+	{ NULL, NULL }
+};
+
+// With VIRTUAL_TIME, drinking and walking away take virtual time drawn from
+// these distributions (see vclock.h) instead of NUM_PEOPLE yields each.
+#ifdef VIRTUAL_TIME
+#include "vclock.h"
+#ifndef SERVICE_DIST
+#define SERVICE_DIST       EXPONENTIAL
+#endif
+#ifndef SERVICE_TIME
+#define SERVICE_TIME       1.0
+#endif
+#ifndef THINK_DIST
+#define THINK_DIST         EXPONENTIAL
+#endif
+#ifndef THINK_TIME
+#define THINK_TIME         ((double) NUM_PEOPLE / MAX_OCCUPANCY)
+#endif
+#define VCLOCK_BLOCK()     vclock_block();
+#define VCLOCK_WAKE(n)     vclock_wake(n);
+#else
+#define VCLOCK_BLOCK()     ;
+#define VCLOCK_WAKE(n)     ;
+#endif
 
 
 /**
@@ -25,6 +77,18 @@
 enum Endianness { LITTLE = 0, BIG = 1 };
 const static enum Endianness oppositeEnd[] = { BIG, LITTLE };
 
+/**
+ * Priorities.  Among the waiters the well would admit, one of a higher
+ * priority goes first.  The endianness and FAIR_WAITING_COUNT rules are the
+ * same for every priority, so they still hold.  A waiter that has seen
+ * STARVATION_BOUND entries go by is starving, which outranks every priority,
+ * so a low priority waits at most about that long once its endianness has the
+ * well.  Waiters are counted by level: 0 is starving, 1 + p is priority p.
+ * With one priority (the default) none of this applies, and admission is as
+ * it was before priorities (bench/check_admission.sh).
+ */
+#define MAX_PRIORITIES 8
+
 int bigs = 0;
 int littles = 0;
 
@@ -36,6 +100,11 @@ struct Well {
 	uthread_mutex_t mx;
 	uthread_cond_t big;
 	uthread_cond_t little;
+	int waiting[2][MAX_PRIORITIES + 1];  // in wait_for_entry, by endianness and level
+	int waiters[2];  // blocked in wait(), by endianness
+#ifdef LOCK_PROFILE
+	struct LockProf* prof;
+#endif
 };
 
 struct Well* createWell() {
@@ -46,37 +115,100 @@ struct Well* createWell() {
 	Well->fair_wait_counter = 0;
 	Well->occupancy = 0;
 	Well->is_new = 1;
+	for (int l = 0; l <= MAX_PRIORITIES; l++)
+		Well->waiting[BIG][l] = Well->waiting[LITTLE][l] = 0;
+	Well->waiters[BIG] = Well->waiters[LITTLE] = 0;
+#ifdef LOCK_PROFILE
+	Well->prof = lockprof_create("Well->mx");
+#endif
 	return Well;
 }
 
 struct Well* Well;
 
+#ifdef FLAT_COMBINING
+#ifdef VIRTUAL_TIME
+#error FLAT_COMBINING drinkers spin while they wait, which the virtual clock cannot see
+#endif
+/**
+ * Flat combining.  Instead of taking Well->mx, a drinker publishes its arrive,
+ * enter, leave or retire request and then waits for it to be done.  While it waits,
+ * whichever drinker grabs the combiner role applies every published request
+ * to the well in one pass (see fc_combine), so the well's state stays in the
+ * combiner's cache for the whole batch instead of moving on every operation.
+ *
+ * An enter that is not admitted right away parks on a condition variable of
+ * its own; Well->mx is only used for parking and waking, never for the well.
+ */
+enum FcOp    { FC_ARRIVE, FC_ENTER, FC_LEAVE, FC_RETIRE };
+enum FcState { FC_PENDING, FC_PARKED, FC_DONE };
+
+struct FcRequest {
+	enum FcOp         op;
+	enum Endianness   g;
+	int               priority;
+	int               initial_time;  // entryTicker when the combiner first saw it
+	int               state;         // enum FcState
+	uthread_cond_t    parked;        // set before state becomes FC_PARKED
+	struct FcRequest* next;
+};
+
+struct FcRequest* fcPublished;  // pushed by any drinker
+struct FcRequest* fcWaiting;    // enters that are not admitted yet, oldest first; combiner only
+int               fcCombining;  // 1 while some drinker holds the combiner role
+
+int fc_apply(enum FcOp op, enum Endianness g, int priority);
+#endif
+
 #define WAITING_HISTOGRAM_SIZE (NUM_ITERATIONS * NUM_PEOPLE)
 int             entryTicker;                                          // incremented with each entry
-int             waitingHistogram[WAITING_HISTOGRAM_SIZE];
+int*            waitingHistogram;
 int             waitingHistogramOverflow;
 uthread_mutex_t waitingHistogrammutex;
-int             occupancyHistogram[2][MAX_OCCUPANCY + 1];
+#ifdef LOCK_PROFILE
+struct LockProf* waitingHistogramProf;
+#endif
+int*            occupancyHistogram[2];                                // [endianness][occupancy]
+#ifdef VIRTUAL_TIME
+double*         waitingTimes;                                         // virtual time waited, by entry
+#endif
 
-void lock() {
-	uthread_mutex_lock(Well->mx);
+// how long each admission of a priority waited
+struct BenchWaits priorityWaits[MAX_PRIORITIES];
+
+LOCKPROF_WRAPPER void lock() {
+	LOCKPROF_LOCK(Well->prof, uthread_mutex_lock(Well->mx));
+}
+
+LOCKPROF_WRAPPER void unlock() {
+	LOCKPROF_UNLOCK(Well->prof, uthread_mutex_unlock(Well->mx));
 }
 
-void unlock() {
-	uthread_mutex_unlock(Well->mx);
+// Lock held.  Count the waiters released by a signal (n == 1) or a broadcast
+// (n == -1) as wake-ups, and tell the clock about them.
+void count_wakeups(enum Endianness g, int n) {
+	if (n < 0 || n > Well->waiters[g])
+		n = Well->waiters[g];
+	Well->waiters[g] -= n;
+	bench_wakeup(n);
+	VCLOCK_WAKE(n);
 }
 
-void wait(enum Endianness endianness) {
+LOCKPROF_WRAPPER void wait(enum Endianness endianness) {
+	Well->waiters[endianness]++;
+	VCLOCK_BLOCK();
+	TRACE_EVENT(TRACE_COND_WAIT_BEGIN, endianness);
 	if (endianness == BIG) {
-		uthread_cond_wait(Well->big);
+		LOCKPROF_COND_WAIT(Well->prof, uthread_cond_wait(Well->big));
 	}
 	else {
-		uthread_cond_wait(Well->little);
+		LOCKPROF_COND_WAIT(Well->prof, uthread_cond_wait(Well->little));
 	}
+	TRACE_EVENT(TRACE_COND_WAIT_END, endianness);
 }
 
-void recordWaitingTime(int waitingTime) {
-	uthread_mutex_lock(waitingHistogrammutex);
+LOCKPROF_WRAPPER void recordWaitingTime(int waitingTime) {
+	LOCKPROF_LOCK(waitingHistogramProf, uthread_mutex_lock(waitingHistogrammutex));
 	if (waitingTime < WAITING_HISTOGRAM_SIZE)
 		waitingHistogram[waitingTime] ++;
 	else
@@ -85,11 +217,27 @@ void recordWaitingTime(int waitingTime) {
 	// update occupancyHistogram
 	occupancyHistogram[Well->endianness][Well->occupancy]++;
 
-	uthread_mutex_unlock(waitingHistogrammutex);
+	LOCKPROF_UNLOCK(waitingHistogramProf, uthread_mutex_unlock(waitingHistogrammutex));
+}
+
+// Lock held.  Is someone of endianness g waiting at a level before level?
+int outranked(enum Endianness g, int level) {
+	for (int l = 0; l < level; l++)
+		if (Well->waiting[g][l])
+			return 1;
+	return 0;
+}
+
+// Lock held.  Is someone of endianness g waiting at a level after level?
+int outranks(enum Endianness g, int level) {
+	for (int l = level + 1; l <= NUM_PRIORITIES; l++)
+		if (Well->waiting[g][l])
+			return 1;
+	return 0;
 }
 
 // Note: this is critical section (lock is held)
-void wait_for_entry(enum Endianness g) {
+void wait_for_entry(enum Endianness g, int priority, int initial_time) {
 	// Cases:
 	// 1. the well is fresh. In that case, drink out of it.
 	if (Well->is_new) {
@@ -97,9 +245,25 @@ void wait_for_entry(enum Endianness g) {
 		return;
 	}
 	// 2. Wait until the well is available with re-waiting if there is competition.
-	while (Well->occupancy == MAX_OCCUPANCY || Well->fair_wait_counter == FAIR_WAITING_COUNT || Well->endianness != g)
+	int prioritized = NUM_PRIORITIES > 1;
+	int level = 1 + priority;
+	Well->waiting[g][level]++;
+	while (Well->occupancy == MAX_OCCUPANCY || Well->fair_wait_counter == FAIR_WAITING_COUNT || Well->endianness != g
+		|| (prioritized && outranked(g, level)))
 	{
 		wait(g);
+		if (prioritized && level > 0 && entryTicker - initial_time >= STARVATION_BOUND) {
+			Well->waiting[g][level]--;
+			level = 0;
+			Well->waiting[g][level]++;
+		}
+	}
+	Well->waiting[g][level]--;
+	// 3. Those it outranked may be able to go now, and nobody else will tell them.
+	if (prioritized && outranks(g, level)) {
+		count_wakeups(g, -1);
+		TRACE_EVENT(TRACE_COND_BROADCAST, g);
+		uthread_cond_broadcast(g == BIG ? Well->big : Well->little);
 	}
 	return;
 }
@@ -111,19 +275,37 @@ void drink(enum Endianness g) {
 	Well->fair_wait_counter++;
 }
 
-// attempt to enter the well
-void enterWell(enum Endianness g) {
+// attempt to enter the well; arrived_ns is when g got in line (a bench_now() time)
+void enterWell(enum Endianness g, int priority, long long arrived_ns) {
 	// attempt to get in the well
+	int waited;  // entries
+#ifdef FLAT_COMBINING
+	waited = fc_apply(FC_ENTER, g, priority);
+	TRACE_EVENT(TRACE_ENTER, g);
+	bench_latency(bench_now() - arrived_ns);
+	bench_wait(&priorityWaits[priority], waited, bench_now() - arrived_ns);
+	return;
+#endif
 	lock();
 	int initial_time = entryTicker;
+#ifdef VIRTUAL_TIME
+	double start = vclock_time();
+#endif
 
-	wait_for_entry(g);
+	wait_for_entry(g, priority, initial_time);
 	drink(g);
+	TRACE_EVENT(TRACE_ENTER, g);
 
-	recordWaitingTime(entryTicker - initial_time);
+	waited = entryTicker - initial_time;
+	recordWaitingTime(waited);
+#ifdef VIRTUAL_TIME
+	waitingTimes[entryTicker] = vclock_time() - start;
+#endif
 	entryTicker++;
 
 	unlock();
+	bench_latency(bench_now() - arrived_ns);
+	bench_wait(&priorityWaits[priority], waited, bench_now() - arrived_ns);
 }
 
 // Lock held.
@@ -149,13 +331,19 @@ void broadcast(){
 	//printf("Broadcasting. Bigs = %d", bigs);
 	//printf(", Littles = %d\n", littles);
 	if (bigs == 0) {
+		count_wakeups(LITTLE, -1);
+		TRACE_EVENT(TRACE_COND_BROADCAST, LITTLE);
 		uthread_cond_broadcast(Well->little);
 		return;
 	}
 	if (littles == 0) {
+		count_wakeups(BIG, -1);
+		TRACE_EVENT(TRACE_COND_BROADCAST, BIG);
 		uthread_cond_broadcast(Well->big);
 		return;
 	}
+	count_wakeups(Well->endianness, -1);
+	TRACE_EVENT(TRACE_COND_BROADCAST, Well->endianness);
 	if (Well->endianness == BIG) {
 		uthread_cond_broadcast(Well->big);
 	}
@@ -166,13 +354,19 @@ void broadcast(){
 
 void signal() {
 	if (bigs == 0) {
+		count_wakeups(LITTLE, 1);
+		TRACE_EVENT(TRACE_COND_SIGNAL, LITTLE);
 		uthread_cond_signal(Well->little);
 		return;
 	}
 	if (littles == 0) {
+		count_wakeups(BIG, 1);
+		TRACE_EVENT(TRACE_COND_SIGNAL, BIG);
 		uthread_cond_signal(Well->big);
 		return;
 	}
+	count_wakeups(Well->endianness, 1);
+	TRACE_EVENT(TRACE_COND_SIGNAL, Well->endianness);
 	if (Well->endianness == BIG) {
 		uthread_cond_signal(Well->big);
 	}
@@ -183,7 +377,8 @@ void signal() {
 
 // Lock held.
 void zero_occupancy_policy() {
-	if (Well->fair_wait_counter == FAIR_WAITING_COUNT) {
+	// or when nobody of this endianness is left to use up the count
+	if (Well->fair_wait_counter == FAIR_WAITING_COUNT || (Well->endianness == BIG ? bigs : littles) == 0) {
 		change_well_endianness();
 		// reset fairness
 		Well->fair_wait_counter = 0;
@@ -211,93 +406,490 @@ void signal_the_next() {
 
 
 
-void leaveWell() {
+#ifdef FLAT_COMBINING
+// Combiner only.
+int fc_waiting_for(enum Endianness g) {
+	for (struct FcRequest* r = fcWaiting; r; r = r->next)
+		if (r->g == g)
+			return 1;
+	return 0;
+}
+
+// Combiner only.  r must not be touched after this.
+void fc_done(struct FcRequest* r) {
+	int pending = FC_PENDING;
+	if (__atomic_compare_exchange_n(&r->state, &pending, FC_DONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+	// parked, and its owner only sees FC_DONE under the lock, so r lives until unlock
 	lock();
-	Well->occupancy--;
-	signal_the_next();
+	__atomic_store_n(&r->state, FC_DONE, __ATOMIC_RELEASE);
+	bench_wakeup(1);
+	uthread_cond_signal(r->parked);
 	unlock();
 }
 
-void decrement_drinker_count(enum Endianness g, int i) {
-	if (i == NUM_ITERATIONS - 1) {
-		lock();
-		if (g == BIG) {
-			bigs--;
-			//printf("A big is done drinking 100x\n");
+// Combiner only.  One pass over everything published since the last pass.
+void fc_combine() {
+	struct FcRequest* batch = __atomic_exchange_n(&fcPublished, NULL, __ATOMIC_ACQUIRE);
+	struct FcRequest* fifo = NULL;
+	struct FcRequest** tail;
+
+	// published newest first
+	while (batch) {
+		struct FcRequest* next = batch->next;
+		batch->next = fifo;
+		fifo = batch;
+		batch = next;
+	}
+
+	// arrivals, leaves and retires are done at once; enters join the end of the waiting list
+	for (tail = &fcWaiting; *tail; tail = &(*tail)->next)
+		;
+	while (fifo) {
+		struct FcRequest* r = fifo;
+		fifo = r->next;
+		switch (r->op) {
+		case FC_ARRIVE:
+			if (r->g == BIG)
+				bigs++;
+			else
+				littles++;
+			fc_done(r);
+			break;
+		case FC_LEAVE:
+			Well->occupancy--;
+			fc_done(r);
+			break;
+		case FC_RETIRE:
+			if (r->g == BIG)
+				bigs--;
+			else
+				littles--;
+			fc_done(r);
+			break;
+		case FC_ENTER:
+			r->initial_time = entryTicker;
+			r->next = NULL;
+			*tail = r;
+			tail = &r->next;
+			break;
+		}
+	}
+	if (fcWaiting == NULL)
+		return;
+
+	// the same policy as zero_occupancy_policy, except that an empty well also
+	// goes to whoever is waiting when nobody of its endianness is
+	if (Well->is_new) {
+		Well->is_new = 0;
+		Well->endianness = fcWaiting->g;
+	}
+	if (Well->occupancy == 0) {
+		if (Well->fair_wait_counter == FAIR_WAITING_COUNT) {
+			change_well_endianness();
+			Well->fair_wait_counter = 0;
 		}
-		else {
-			littles--;
-			//printf("A little is done drinking 100x\n");
+		if (!fc_waiting_for(Well->endianness)) {
+			Well->endianness = oppositeEnd[Well->endianness];
+			Well->fair_wait_counter = 0;
 		}
+	}
+
+	// admit eligible waiters, the oldest of the first level (see wait_for_entry) first
+	while (Well->occupancy < MAX_OCCUPANCY && Well->fair_wait_counter < FAIR_WAITING_COUNT) {
+		struct FcRequest** best = NULL;
+		int best_level = MAX_PRIORITIES + 1;
+		for (tail = &fcWaiting; *tail; tail = &(*tail)->next) {
+			struct FcRequest* r = *tail;
+			int level = NUM_PRIORITIES > 1 && entryTicker - r->initial_time >= STARVATION_BOUND ? 0 : 1 + r->priority;
+			if (r->g == Well->endianness && level < best_level) {
+				best = tail;
+				best_level = level;
+			}
+		}
+		if (best == NULL)
+			break;
+		struct FcRequest* r = *best;
+		drink(r->g);
+		r->initial_time = entryTicker - r->initial_time;  // now how long it waited
+		recordWaitingTime(r->initial_time);
+		entryTicker++;
+		*best = r->next;
+		fc_done(r);
+	}
+}
+
+// Combine unless someone else is.  A combiner keeps going until nothing is
+// published, so a request pushed while it was busy is never left behind.
+void fc_try_combine() {
+	while (__atomic_load_n(&fcPublished, __ATOMIC_ACQUIRE) && !__atomic_exchange_n(&fcCombining, 1, __ATOMIC_ACQUIRE)) {
+		do {
+			fc_combine();
+		} while (__atomic_load_n(&fcPublished, __ATOMIC_ACQUIRE));
+		__atomic_store_n(&fcCombining, 0, __ATOMIC_RELEASE);
+	}
+}
+
+// Publish a request and wait until it has been applied; for an enter, returns how many entries it waited.
+int fc_apply(enum FcOp op, enum Endianness g, int priority) {
+	struct FcRequest r = { op, g, priority, 0, FC_PENDING, NULL, NULL };
+	r.next = __atomic_load_n(&fcPublished, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&fcPublished, &r.next, &r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	fc_try_combine();
+
+	// not admitted in this pass, so it may be a while; park until fc_done
+	if (op == FC_ENTER && __atomic_load_n(&r.state, __ATOMIC_ACQUIRE) != FC_DONE) {
+		int pending = FC_PENDING;
+		lock();
+		r.parked = uthread_cond_create(Well->mx);
+		if (__atomic_compare_exchange_n(&r.state, &pending, FC_PARKED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			while (__atomic_load_n(&r.state, __ATOMIC_ACQUIRE) != FC_DONE)
+				uthread_cond_wait(r.parked);
 		unlock();
+		uthread_cond_destroy(r.parked);
+	}
+
+	// arrivals, leaves and retires are applied by the next pass, which is never far off
+	while (__atomic_load_n(&r.state, __ATOMIC_ACQUIRE) != FC_DONE) {
+		uthread_yield();
+		fc_try_combine();
 	}
+	return r.initial_time;
 }
+#endif
 
-void drinker(enum Endianness g) {
+// g is the leaving drinker's endianness, which is the well's while it is in it
+void leaveWell(enum Endianness g) {
+#ifdef FLAT_COMBINING
+	TRACE_EVENT(TRACE_LEAVE, g);
+	fc_apply(FC_LEAVE, g, 0);
+	return;
+#endif
+	lock();
+	TRACE_EVENT(TRACE_LEAVE, g);
+	Well->occupancy--;
+	signal_the_next();
+	unlock();
+}
+
+// One more of g will want to drink (replay; otherwise main counts them all at the start).
+void arrive(enum Endianness g) {
+#ifdef FLAT_COMBINING
+	fc_apply(FC_ARRIVE, g, 0);
+	return;
+#endif
+	lock();
+	if (g == BIG)
+		bigs++;
+	else
+		littles++;
+	// an empty well nobody of its endianness wants would never come to g otherwise
+	if (Well->occupancy == 0 && (Well->endianness == BIG ? bigs : littles) == 0) {
+		Well->endianness = g;
+		Well->fair_wait_counter = 0;
+	}
+	unlock();
+}
+
+// g will not want to drink again.
+void retire(enum Endianness g) {
+#ifdef FLAT_COMBINING
+	fc_apply(FC_RETIRE, g, 0);
+	return;
+#endif
+	lock();
+	if (g == BIG)
+		bigs--;
+	else
+		littles--;
+	unlock();
+}
+
+void decrement_drinker_count(enum Endianness g, int i) {
+	if (i == NUM_ITERATIONS - 1)
+		retire(g);
+}
+
+void drinker(enum Endianness g, int priority) {
+#ifdef VIRTUAL_TIME
+	struct VSleeper* s = vclock_sleeper_create(rand());
+	for (int i = 0; i < NUM_ITERATIONS; i++) {
+		enterWell(g, priority, bench_now());
+		decrement_drinker_count(g, i);
+		vclock_sleep(s, dist_sample(s, SERVICE_DIST, SERVICE_TIME));
+		leaveWell(g);
+		vclock_sleep(s, dist_sample(s, THINK_DIST, THINK_TIME));
+	}
+	vclock_exit();
+#else
+	int yields = NUM_YIELDS ? NUM_YIELDS : NUM_PEOPLE;
 	for (int i = 0; i < NUM_ITERATIONS; i++) {
-		enterWell(g);
+		enterWell(g, priority, bench_now());
 		decrement_drinker_count(g, i);
-		for (int j = 0; j < NUM_PEOPLE; j++) {
+		for (int j = 0; j < yields; j++) {
 			uthread_yield();
 		}
-		leaveWell();
-		for (int j = 0; j < NUM_PEOPLE; j++) {
+		leaveWell(g);
+		for (int j = 0; j < yields; j++) {
 			uthread_yield();
 		}
 	}
+#endif
 }
 
+// arg is the priority
 void* big_endian_drinker(void* arg) {
-	drinker(BIG);
+	drinker(BIG, (int) (intptr_t) arg);
 	return NULL;
 }
 
 void* little_endian_drinker(void* arg) {
-	drinker(LITTLE);
+	drinker(LITTLE, (int) (intptr_t) arg);
 	return NULL;
 }
 
+/**
+ * Replay.  With $REPLAY_FILE set (- for stdin), the drinkers are not
+ * NUM_PEOPLE coin flips that drink NUM_ITERATIONS times each but the arrivals
+ * of that trace, one per line:
+ *
+ *   time_us big|little service_us [priority]
+ *
+ * time_us is from any origin, b and l will do for the endianness, the drinker
+ * stays in the well for service_us, and # starts a comment.  Both times are
+ * scaled by TIME_SCALE percent.
+ *
+ * main reads the trace as it goes and hands each arrival, when it is due, to a
+ * pool of NUM_PEOPLE drinkers through a queue of REPLAY_QUEUE, so memory does
+ * not grow with the trace.  Waits count from when the arrival was due, so
+ * they include any time it sat in the queue because the whole pool was busy;
+ * how late the pool got to arrivals is reported too.
+ */
+struct Arrival {
+	long long       due_ns;
+	enum Endianness g;
+	int             priority;
+	long long       service_ns;
+};
+
+struct Arrival* replayQueue;       // ring, oldest at replayHead
+int             replayHead;
+int             replayLength;
+int             replayDone;        // nothing more will be queued
+long long       replayMaxLateNs;   // from due to taken off the queue
+uthread_mutex_t replayMx;
+uthread_cond_t  replayNotEmpty;
+uthread_cond_t  replayNotFull;
+
+// Reads the next arrival of f, with due_ns from the trace's origin; returns 0 at its end.
+int readArrival(FILE* f, const char* name, int* line, struct Arrival* a) {
+	char buf[256], end[16];
+	while (fgets(buf, sizeof(buf), f)) {
+		(*line)++;
+		char* s = buf + strspn(buf, " \t\r\n");
+		if (*s == '\0' || *s == '#')
+			continue;
+		long long time_us, service_us;
+		a->priority = 0;
+		int n = sscanf(s, "%lld %15s %lld %d", &time_us, end, &service_us, &a->priority);
+		if (n < 3 || (end[0] != 'b' && end[0] != 'l') || service_us < 0 || a->priority < 0 || a->priority >= NUM_PRIORITIES) {
+			fprintf(stderr, "%s:%d: expected time_us big|little service_us [priority < num_priorities]\n", name, *line);
+			exit(1);
+		}
+		a->due_ns = time_us * 1000;
+		a->g = end[0] == 'b' ? BIG : LITTLE;
+		a->service_ns = service_us * 1000 * TIME_SCALE / 100;
+		return 1;
+	}
+	return 0;
+}
+
+void* replayDrinker(void* v) {
+	while (1) {
+		uthread_mutex_lock(replayMx);
+		while (replayLength == 0 && !replayDone)
+			uthread_cond_wait(replayNotEmpty);
+		if (replayLength == 0) {
+			uthread_mutex_unlock(replayMx);
+			return NULL;
+		}
+		struct Arrival a = replayQueue[replayHead];
+		replayHead = (replayHead + 1) % REPLAY_QUEUE;
+		replayLength--;
+		if (bench_now() - a.due_ns > replayMaxLateNs)
+			replayMaxLateNs = bench_now() - a.due_ns;
+		uthread_cond_signal(replayNotFull);
+		uthread_mutex_unlock(replayMx);
+
+		arrive(a.g);
+		enterWell(a.g, a.priority, a.due_ns);
+		retire(a.g);
+		for (long long end = bench_now() + a.service_ns; bench_now() < end; )
+			uthread_yield();
+		leaveWell(a.g);
+	}
+}
+
+// After bench_start; returns how many arrivals it replayed.
+int replay(const char* name) {
+	FILE* f = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+	if (f == NULL) {
+		perror(name);
+		exit(1);
+	}
+	replayQueue = malloc(REPLAY_QUEUE * sizeof(struct Arrival));
+	replayMx = uthread_mutex_create();
+	replayNotEmpty = uthread_cond_create(replayMx);
+	replayNotFull = uthread_cond_create(replayMx);
+	uthread_t pt[NUM_PEOPLE];
+	for (int i = 0; i < NUM_PEOPLE; i++)
+		pt[i] = uthread_create(replayDrinker, NULL);
+
+	struct Arrival a;
+	int line = 0, arrivals = 0;
+	long long origin = 0;
+	while (readArrival(f, name, &line, &a)) {
+		if (arrivals++ == 0)
+			origin = a.due_ns;
+		a.due_ns = bench_start_ns + (a.due_ns - origin) * TIME_SCALE / 100;
+		while (bench_now() < a.due_ns)
+			uthread_yield();
+		uthread_mutex_lock(replayMx);
+		while (replayLength == REPLAY_QUEUE)
+			uthread_cond_wait(replayNotFull);
+		replayQueue[(replayHead + replayLength++) % REPLAY_QUEUE] = a;
+		uthread_cond_signal(replayNotEmpty);
+		uthread_mutex_unlock(replayMx);
+	}
+	uthread_mutex_lock(replayMx);
+	replayDone = 1;
+	uthread_cond_broadcast(replayNotEmpty);
+	uthread_mutex_unlock(replayMx);
+	if (f != stdin)
+		fclose(f);
+
+	for (int i = 0; i < NUM_PEOPLE; i++)
+		uthread_join(pt[i], NULL);
+	return arrivals;
+}
+
 
 int main(int argc, char** argv) {
-	uthread_init(1);
+	bench_init(argc, argv, params);
+	uthread_init(NUM_PROCESSORS);
 	Well = createWell();
 	uthread_t pt[NUM_PEOPLE];
+	waitingHistogram = calloc(WAITING_HISTOGRAM_SIZE, sizeof(int));
+	occupancyHistogram[LITTLE] = calloc(MAX_OCCUPANCY + 1, sizeof(int));
+	occupancyHistogram[BIG] = calloc(MAX_OCCUPANCY + 1, sizeof(int));
+#ifdef VIRTUAL_TIME
+	waitingTimes = calloc(WAITING_HISTOGRAM_SIZE, sizeof(double));
+#endif
+	if (NUM_PRIORITIES < 1 || NUM_PRIORITIES > MAX_PRIORITIES) {
+		fprintf(stderr, "num_priorities must be 1 to %d\n", MAX_PRIORITIES);
+		return 1;
+	}
+	const char* replayFile = getenv("REPLAY_FILE");
+	if (replayFile && (NUM_PEOPLE < 1 || REPLAY_QUEUE < 1 || TIME_SCALE < 0)) {
+		fprintf(stderr, "replay needs num_people >= 1, replay_queue >= 1 and time_scale >= 0\n");
+		return 1;
+	}
+#ifdef VIRTUAL_TIME
+	if (replayFile) {
+		fprintf(stderr, "replay runs in real time, not with VIRTUAL_TIME\n");
+		return 1;
+	}
+#endif
+	for (int p = 0; p < NUM_PRIORITIES; p++)
+		bench_waits_init(&priorityWaits[p], WAITING_HISTOGRAM_SIZE);
 	waitingHistogrammutex = uthread_mutex_create();
+#ifdef LOCK_PROFILE
+	waitingHistogramProf = lockprof_create("waitingHistogrammutex");
+#endif
 
-	srand(time(NULL));
-
-	// Start the threads, half big half little
-	for (int i = 0; i < NUM_PEOPLE; i++)
-	{
-		int random = rand();
-		//printf("%d\n", random);
-		if (random % 2 == 0) {
-			bigs++;
-			pt[i] = uthread_create(big_endian_drinker, NULL);
+	srand(SEED ? SEED : time(NULL));
+#ifdef VIRTUAL_TIME
+	vclock_init(NUM_PEOPLE);
+#endif
+	bench_start(WAITING_HISTOGRAM_SIZE);
+	metrics_int("entries", &entryTicker);
+	metrics_int("bigs", &bigs);
+	metrics_int("littles", &littles);
+	metrics_ints("occupancy[big]", occupancyHistogram[BIG], MAX_OCCUPANCY + 1);
+	metrics_ints("occupancy[little]", occupancyHistogram[LITTLE], MAX_OCCUPANCY + 1);
+	metrics_int("waited overflow", &waitingHistogramOverflow);
+	metrics_ints("waited", waitingHistogram, WAITING_HISTOGRAM_SIZE < 16 ? WAITING_HISTOGRAM_SIZE : 16);
+	metrics_start(argv[0]);
+
+	int arrivals = 0;
+	long drinkerVirtual = 0, drinkerResident = 0;  // memory per drinker, bytes
+	if (replayFile)
+		arrivals = replay(replayFile);
+	else {
+		long virtual0, resident0, virtual1, resident1;
+		bench_memory(&virtual0, &resident0);
+
+		// Start the threads, half big half little
+		for (int i = 0; i < NUM_PEOPLE; i++)
+		{
+			int random = rand();
+			//printf("%d\n", random);
+			if (random % 2 == 0) {
+				bigs++;
+				pt[i] = uthread_create(big_endian_drinker, (void*) (intptr_t) (i % NUM_PRIORITIES));
+			}
+			else {
+				littles++;
+				pt[i] = uthread_create(little_endian_drinker, (void*) (intptr_t) (i % NUM_PRIORITIES));
+			}
 		}
-		else {
-			littles++;
-			pt[i] = uthread_create(little_endian_drinker, NULL);
+		//printf("There are %d many bigs\n", bigs);
+		//printf("There are %d many littles\n", littles);
+		bench_memory(&virtual1, &resident1);
+		drinkerVirtual = (virtual1 - virtual0) / NUM_PEOPLE;
+		drinkerResident = (resident1 - resident0) / NUM_PEOPLE;
+
+		for (int i = 0; i < NUM_PEOPLE; i++) {
+			uthread_join(pt[i], NULL);
 		}
 	}
-	//printf("There are %d many bigs\n", bigs);
-	//printf("There are %d many littles\n", littles);
-
 
-	for (int i = 0; i < NUM_PEOPLE; i++) {
-		uthread_join(pt[i], NULL);
-	}
+	bench_stop();
+	double elapsed = bench_elapsed_ns / 1e9;
 
-	printf("Times with 1 little endian %d\n", occupancyHistogram[LITTLE][1]);
-	printf("Times with 2 little endian %d\n", occupancyHistogram[LITTLE][2]);
-	printf("Times with 3 little endian %d\n", occupancyHistogram[LITTLE][3]);
-	printf("Times with 1 big endian    %d\n", occupancyHistogram[BIG][1]);
-	printf("Times with 2 big endian    %d\n", occupancyHistogram[BIG][2]);
-	printf("Times with 3 big endian    %d\n", occupancyHistogram[BIG][3]);
+	for (int i = 1; i <= MAX_OCCUPANCY; i++)
+		printf("Times with %d little endian %d\n", i, occupancyHistogram[LITTLE][i]);
+	for (int i = 1; i <= MAX_OCCUPANCY; i++)
+		printf("Times with %d big endian    %d\n", i, occupancyHistogram[BIG][i]);
 	printf("Waiting Histogram\n");
 	for (int i = 0; i < WAITING_HISTOGRAM_SIZE; i++)
 		if (waitingHistogram[i])
 			printf("  Number of times people waited for %d %s to enter: %d\n", i, i == 1 ? "person" : "people", waitingHistogram[i]);
 	if (waitingHistogramOverflow)
 		printf("  Number of times people waited more than %d entries: %d\n", WAITING_HISTOGRAM_SIZE, waitingHistogramOverflow);
+	if (!replayFile)
+		printf("Memory per drinker: %ld bytes virtual, %ld resident\n", drinkerVirtual, drinkerResident);
+	printf("Entries per second: %.0f (%d entries in %.3f s)\n", entryTicker / elapsed, entryTicker, elapsed);
+	if (replayFile) {
+		long n = bench_num_latencies < bench_max_latencies ? bench_num_latencies : bench_max_latencies;
+		qsort(bench_latencies, n, sizeof(long long), bench_compare);
+		printf("Replayed %d arrivals at %d%% of the trace's times: waited p50 %.1f p90 %.1f p99 %.1f max %.1f us; drinkers up to %.1f us late\n",
+			arrivals, TIME_SCALE, bench_percentile(n, 0.5) / 1e3, bench_percentile(n, 0.9) / 1e3,
+			bench_percentile(n, 0.99) / 1e3, bench_percentile(n, 1) / 1e3, replayMaxLateNs / 1e3);
+	}
+	if (NUM_PRIORITIES > 1) {
+		char name[24];
+		for (int p = 0; p < NUM_PRIORITIES; p++) {
+			snprintf(name, sizeof(name), "Priority %d", p);
+			bench_print_waits(name, &priorityWaits[p]);
+		}
+	}
+#ifdef VIRTUAL_TIME
+	printf("Virtual time: %.3f, %.3f entries per unit (service %s %.3f, think %s %.3f)\n",
+		vclock_time(), entryTicker / vclock_time(),
+		dist_name[SERVICE_DIST], (double) SERVICE_TIME, dist_name[THINK_DIST], (double) THINK_TIME);
+	vclock_print_latency("Virtual waiting time", waitingTimes, entryTicker);
+#endif
+	bench_report(argv[0], entryTicker);
 }
@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include "uthread.h"
+#include "uthread_mutex_cond.h"
+#include "coro.h"
+#include "bench.h"
+
+/**
+ * The well from well.c, with each drinker run as a stackless coroutine instead
+ * of a uthread.  The admission policy is the same as well.c; the condition
+ * variables are replaced by coroutine wait queues, and a drinker that has to
+ * wait just parks itself and returns to its event loop.  See broadcast() and
+ * zero_occupancy_policy() for where waking differs from well.c.
+ *
+ * Every parameter can be overridden at compile time, e.g.
+ *   -DNUM_PEOPLE=1000000 -DNUM_ITERATIONS=4 -DNUM_YIELDS=2 -DNUM_PROCESSORS=4
+ */
+
+#ifndef MAX_OCCUPANCY
+#define MAX_OCCUPANCY      3
+#endif
+#ifndef NUM_ITERATIONS
+#define NUM_ITERATIONS     100
+#endif
+#ifndef NUM_PEOPLE
+#define NUM_PEOPLE         20
+#endif
+#ifndef FAIR_WAITING_COUNT
+#define FAIR_WAITING_COUNT 4
+#endif
+#ifndef NUM_YIELDS
+#define NUM_YIELDS         NUM_PEOPLE   // yields spent drinking and walking away, as in well.c
+#endif
+#ifndef NUM_PROCESSORS
+#define NUM_PROCESSORS     1
+#endif
+#if NUM_PEOPLE < 1 || MAX_OCCUPANCY < 1
+#error "NUM_PEOPLE and MAX_OCCUPANCY must be at least 1"
+#endif
+
+enum Endianness { LITTLE = 0, BIG = 1 };
+
+int bigs = 0;
+int littles = 0;
+
+struct Well {
+	int occupancy;
+	int fair_wait_counter;
+	int is_new;
+	enum Endianness endianness;
+	uthread_mutex_t mx;
+	struct CoroQueue waiting[2];  // indexed by endianness; replaces the big and little conds
+	int waking;                   // woken drinkers that have not re-checked yet
+};
+
+struct Well* createWell() {
+	struct Well* Well = calloc(1, sizeof(struct Well));
+	Well->mx = uthread_mutex_create();
+	Well->fair_wait_counter = 0;
+	Well->occupancy = 0;
+	Well->is_new = 1;
+	return Well;
+}
+
+struct Well* Well;
+
+// resume points of a drinker
+enum DrinkerState { ENTERING = 0, WAITING, DRINKING, WALKING };
+
+struct Drinker {
+	struct Coro     c;
+	enum Endianness g;
+	int             i;             // iteration
+	int             j;             // yields done in the current drink or walk
+	int             initial_time;  // entryTicker when this entry attempt started
+};
+
+#define WAITING_HISTOGRAM_SIZE (NUM_ITERATIONS * NUM_PEOPLE)
+int             entryTicker;                                          // incremented with each entry
+int             waitingHistogram[WAITING_HISTOGRAM_SIZE];
+int             waitingHistogramOverflow;
+uthread_mutex_t waitingHistogrammutex;
+int             occupancyHistogram[2][MAX_OCCUPANCY + 1];
+
+void lock() {
+	uthread_mutex_lock(Well->mx);
+}
+
+void unlock() {
+	uthread_mutex_unlock(Well->mx);
+}
+
+// Lock held.  Same as uthread_cond_wait, except that the caller returns to its
+// loop instead of blocking; it re-acquires the lock when it is resumed.
+void park(struct Drinker* d) {
+	d->c.state = WAITING;
+	coro_enqueue(&Well->waiting[d->g], &d->c);
+}
+
+void recordWaitingTime(int waitingTime) {
+	uthread_mutex_lock(waitingHistogrammutex);
+	if (waitingTime < WAITING_HISTOGRAM_SIZE)
+		waitingHistogram[waitingTime] ++;
+	else
+		waitingHistogramOverflow++;
+
+	// update occupancyHistogram
+	occupancyHistogram[Well->endianness][Well->occupancy]++;
+
+	uthread_mutex_unlock(waitingHistogrammutex);
+}
+
+// Lock held.
+int can_enter(enum Endianness g) {
+	return !(Well->occupancy == MAX_OCCUPANCY || Well->fair_wait_counter == FAIR_WAITING_COUNT || Well->endianness != g);
+}
+
+// Critical. Lock held.
+void drink(enum Endianness g) {
+	Well->endianness = g;
+	Well->occupancy++;
+	Well->fair_wait_counter++;
+}
+
+// Lock held.
+void change_well_endianness() {
+	if (bigs == 0){
+		Well->endianness = LITTLE;
+		return;
+	}
+	if (littles == 0){
+		Well->endianness = BIG;
+		return;
+	}
+	Well->endianness = Well->endianness == BIG ? LITTLE : BIG;
+}
+
+// Lock held.  Pick the queue that well.c would broadcast or signal.
+enum Endianness next_endianness() {
+	if (bigs == 0)
+		return LITTLE;
+	if (littles == 0)
+		return BIG;
+	return Well->endianness;
+}
+
+// Lock held.  A broadcast in well.c wakes every waiter, and all but the ones
+// that fit go straight back to waiting.  With a million drinkers that herd is
+// the whole cost, so only wake as many as could be admitted right now.  Any
+// change that admits more is followed by another broadcast.
+void broadcast() {
+	enum Endianness g = next_endianness();
+	int room = MAX_OCCUPANCY - Well->occupancy;
+	if (FAIR_WAITING_COUNT - Well->fair_wait_counter < room)
+		room = FAIR_WAITING_COUNT - Well->fair_wait_counter;
+	if (Well->endianness != g)
+		room = 0;
+	struct Coro* c;
+	while (Well->waking < room && (c = coro_dequeue(&Well->waiting[g])) != NULL) {
+		Well->waking++;
+		coro_ready(c);
+	}
+}
+
+// Lock held.  Unlike well.c this wakes waiters even when fairness was not
+// reached.  broadcast() leaves the ones that do not fit asleep, and well.c
+// relies on a drinker coming back from its walk to get things going again;
+// once everyone is waiting, which with a large NUM_PEOPLE is nearly every run,
+// nobody would.
+void zero_occupancy_policy() {
+	if (Well->fair_wait_counter == FAIR_WAITING_COUNT || next_endianness() != Well->endianness) {
+		change_well_endianness();
+		// reset fairness
+		Well->fair_wait_counter = 0;
+	}
+	broadcast();
+}
+
+// Lock held.
+void nonzero_occupancy_policy() {
+	for (int i = 0; i < MAX_OCCUPANCY - Well->occupancy; i++) {
+		broadcast();
+	}
+}
+
+void leaveWell() {
+	lock();
+	Well->occupancy--;
+	if (Well->occupancy == 0)
+		zero_occupancy_policy();
+	else
+		nonzero_occupancy_policy();
+	unlock();
+}
+
+void decrement_drinker_count(enum Endianness g, int i) {
+	if (i == NUM_ITERATIONS - 1) {
+		lock();
+		if (g == BIG)
+			bigs--;
+		else
+			littles--;
+		unlock();
+	}
+}
+
+// One step of drinker() from well.c, resumed at d->c.state.
+enum CoroStatus drinker_step(struct Coro* c) {
+	struct Drinker* d = (struct Drinker*) c;
+	switch (c->state) {
+	case ENTERING:
+		lock();
+		d->initial_time = entryTicker;
+		// the well is fresh, so drink out of it
+		if (Well->is_new) {
+			Well->is_new = 0;
+			goto enter;
+		}
+		// fall through
+	case WAITING:
+		if (c->state == WAITING) {
+			lock();
+			Well->waking--;
+		}
+		if (!can_enter(d->g)) {
+			int was_woken = c->state == WAITING;
+			park(d);
+			// the well changed after we were woken; hand the wake-up on
+			if (was_woken)
+				broadcast();
+			unlock();
+			return CORO_BLOCKED;
+		}
+	enter:
+		drink(d->g);
+		recordWaitingTime(entryTicker - d->initial_time);
+		entryTicker++;
+		unlock();
+
+		decrement_drinker_count(d->g, d->i);
+		d->j = 0;
+		c->state = DRINKING;
+		// fall through
+	case DRINKING:
+		if (d->j++ < NUM_YIELDS)
+			return CORO_YIELD;
+		leaveWell();
+		d->j = 0;
+		c->state = WALKING;
+		// fall through
+	case WALKING:
+		if (d->j++ < NUM_YIELDS)
+			return CORO_YIELD;
+		if (++d->i == NUM_ITERATIONS)
+			return CORO_DONE;
+		c->state = ENTERING;
+		return CORO_YIELD;
+	}
+	assert(0);
+	return CORO_DONE;
+}
+
+int main(int argc, char** argv) {
+	uthread_init(NUM_PROCESSORS);
+	Well = createWell();
+	waitingHistogrammutex = uthread_mutex_create();
+	coro_init(NUM_PROCESSORS, drinker_step);
+
+	srand(time(NULL));
+
+	// timed and measured from before the first drinker, as in well.c
+	long virtual0, resident0, virtual1, resident1;
+	bench_memory(&virtual0, &resident0);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	struct Drinker* people = calloc(NUM_PEOPLE, sizeof(struct Drinker));
+	assert(people);
+
+	// half big half little, spread over the loops
+	for (int i = 0; i < NUM_PEOPLE; i++) {
+		if (rand() % 2 == 0) {
+			bigs++;
+			people[i].g = BIG;
+		}
+		else {
+			littles++;
+			people[i].g = LITTLE;
+		}
+		coro_spawn(&people[i].c, i % NUM_PROCESSORS);
+	}
+	bench_memory(&virtual1, &resident1);
+
+	coro_run();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	assert(entryTicker == NUM_ITERATIONS * NUM_PEOPLE);
+
+	printf("Times with 1 little endian %d\n", occupancyHistogram[LITTLE][1]);
+	printf("Times with 2 little endian %d\n", occupancyHistogram[LITTLE][2]);
+	printf("Times with 3 little endian %d\n", occupancyHistogram[LITTLE][3]);
+	printf("Times with 1 big endian    %d\n", occupancyHistogram[BIG][1]);
+	printf("Times with 2 big endian    %d\n", occupancyHistogram[BIG][2]);
+	printf("Times with 3 big endian    %d\n", occupancyHistogram[BIG][3]);
+	printf("Waiting Histogram\n");
+	for (int i = 0; i < WAITING_HISTOGRAM_SIZE; i++)
+		if (waitingHistogram[i])
+			printf("  Number of times people waited for %d %s to enter: %d\n", i, i == 1 ? "person" : "people", waitingHistogram[i]);
+	if (waitingHistogramOverflow)
+		printf("  Number of times people waited more than %d entries: %d\n", WAITING_HISTOGRAM_SIZE, waitingHistogramOverflow);
+	printf("Memory per drinker: %ld bytes virtual, %ld resident (struct Drinker is %zu)\n",
+		(virtual1 - virtual0) / NUM_PEOPLE, (resident1 - resident0) / NUM_PEOPLE, sizeof(struct Drinker));
+	printf("Entries per second: %.0f (%d entries in %.3f s)\n", entryTicker / elapsed, entryTicker, elapsed);
+	printf("Admission differs from well.c: a broadcast wakes only as many drinkers as fit, "
+		"and an empty well wakes waiters before fairness is reached\n");
+}
@@ -4,8 +4,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include "uthread.h"
-#include "uthread_sem.h"
+#include "fast_sem.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "bench.h"
+#include "metrics.h"
 #include <time.h>
+#include <stdint.h>
 
 #ifdef VERBOSE
 #define VERBOSE_PRINT(S, ...) printf (S, ##__VA_ARGS__);
@@ -13,10 +18,48 @@
 #define VERBOSE_PRINT(S, ...) ;
 #endif
 
-#define MAX_OCCUPANCY      3
-#define NUM_ITERATIONS     100
-#define NUM_PEOPLE         20
-#define FAIR_WAITING_COUNT 4
+// defaults, each can be changed on the command line (see bench.h)
+int MAX_OCCUPANCY      = 3;
+int NUM_ITERATIONS     = 100;
+int NUM_PEOPLE         = 20;
+int FAIR_WAITING_COUNT = 4;
+int NUM_PRIORITIES     = 1;   // drinker i has priority i % NUM_PRIORITIES, 0 the highest
+int STARVATION_BOUND   = 50;  // entries a waiter sees go by before it outranks every priority
+int SEED               = 0;   // for rand(), which picks each drinker's endianness; 0 seeds from the time
+
+struct Param params[] = {
+	{ "max_occupancy",      &MAX_OCCUPANCY,      1 },
+	{ "num_iterations",     &NUM_ITERATIONS,     1 },
+	{ "num_people",         &NUM_PEOPLE,         1 },
+	{ "fair_waiting_count", &FAIR_WAITING_COUNT, 1 },
+	{ "num_priorities",     &NUM_PRIORITIES,     1 },
+	{ "starvation_bound",   &STARVATION_BOUND },
+	{ "seed",               &SEED },
+	{ NULL, NULL }
+};
+
+// With VIRTUAL_TIME, drinking and walking away take virtual time drawn from
+// these distributions (see vclock.h) instead of NUM_PEOPLE yields each.
+#ifdef VIRTUAL_TIME
+#include "vclock.h"
+#ifndef SERVICE_DIST
+#define SERVICE_DIST       EXPONENTIAL
+#endif
+#ifndef SERVICE_TIME
+#define SERVICE_TIME       1.0
+#endif
+#ifndef THINK_DIST
+#define THINK_DIST         EXPONENTIAL
+#endif
+#ifndef THINK_TIME
+#define THINK_TIME         ((double) NUM_PEOPLE / MAX_OCCUPANCY)
+#endif
+#define VCLOCK_BLOCK(g)    will_wait(g);
+#define VCLOCK_WAKE(g)     count_wakeup(g);
+#else
+#define VCLOCK_BLOCK(g)    ;
+#define VCLOCK_WAKE(g)     ;
+#endif
 
 /**
  * You might find these declarations useful.
@@ -24,31 +67,71 @@
 enum Endianness { LITTLE = 0, BIG = 1 };
 const static enum Endianness oppositeEnd[] = { BIG, LITTLE };
 
+/**
+ * Priorities.  Each endianness has a queue per priority, and a signal for an
+ * endianness releases a waiter of its most urgent queue: the highest priority,
+ * unless some queue's oldest waiter has seen STARVATION_BOUND entries go by,
+ * which then goes first.  Who is signalled and when is unchanged, so the
+ * FAIR_WAITING_COUNT rules still hold.  A signal nobody is waiting for yet is
+ * kept in spare and lets the next waiter of that endianness straight through.
+ * With one priority (the default) there is one queue and nobody starves, so
+ * admission is as it was before priorities (bench/check_admission.sh).
+ */
+#define MAX_PRIORITIES 8
+
+struct Queue {
+	fast_sem_t sem;
+	int*       arrivals;  // entryTicker when each waiter arrived, oldest first
+	int        head;
+	int        length;    // waiters not signalled yet
+};
+
 int bigs = 0;
 int littles = 0;
 
 struct Well {
 	enum Endianness endianness;
-	uthread_sem_t mx;
-	uthread_sem_t big;
-	uthread_sem_t little;
+	fast_sem_t mx;
+	struct Queue queues[2][MAX_PRIORITIES];  // by endianness and priority
+	int spare[2];
 	int bigs_incoming;
 	int littles_incoming;
 	int occupancy;
 	int fair_count;
 	int is_new;
+#ifdef VIRTUAL_TIME
+	int waiters[2];  // blocked (or about to block) on big / little
+	int tokens[2];   // signals that nobody was blocked for yet
+#endif
+#ifdef LOCK_PROFILE
+	struct LockProf* prof;
+#endif
 };
 
 struct Well* createWell() {
 	struct Well* Well = malloc(sizeof(struct Well));
-	Well->mx = uthread_sem_create(1);
-	Well->big = uthread_sem_create(0);
-	Well->little = uthread_sem_create(0);
+	Well->mx = fast_sem_create(1);
+	for (int g = LITTLE; g <= BIG; g++) {
+		for (int p = 0; p < MAX_PRIORITIES; p++) {
+			Well->queues[g][p].sem = fast_sem_create(0);
+			Well->queues[g][p].arrivals = malloc(NUM_PEOPLE * sizeof(int));
+			Well->queues[g][p].head = 0;
+			Well->queues[g][p].length = 0;
+		}
+		Well->spare[g] = 0;
+	}
 	Well->bigs_incoming = 0;
 	Well->littles_incoming = 0;
 	Well->occupancy = 0;
 	Well->fair_count = 0;
 	Well->is_new = 1;
+#ifdef VIRTUAL_TIME
+	Well->waiters[BIG] = Well->waiters[LITTLE] = 0;
+	Well->tokens[BIG] = Well->tokens[LITTLE] = 0;
+#endif
+#ifdef LOCK_PROFILE
+	Well->prof = lockprof_create("Well->mx");
+#endif
 	return Well;
 }
 
@@ -56,50 +139,127 @@ struct Well* Well;
 
 #define WAITING_HISTOGRAM_SIZE (NUM_ITERATIONS * NUM_PEOPLE)
 int             entryTicker;                                          // incremented with each entry
-int             waitingHistogram[WAITING_HISTOGRAM_SIZE];
+int*            waitingHistogram;
 int             waitingHistogramOverflow;
-uthread_sem_t   waitingHistogramMutex;
-int             occupancyHistogram[2][MAX_OCCUPANCY + 1];
+fast_sem_t      waitingHistogramMutex;
+#ifdef LOCK_PROFILE
+struct LockProf* waitingHistogramProf;
+#endif
+int*            occupancyHistogram[2];                                // [endianness][occupancy]
+#ifdef VIRTUAL_TIME
+double*         waitingTimes;                                         // virtual time waited, by entry
+#endif
+
+// how long each admission of a priority waited
+struct BenchWaits priorityWaits[MAX_PRIORITIES];
 
 
-void lock() {
-	uthread_sem_wait(Well->mx);
+LOCKPROF_WRAPPER void lock() {
+	LOCKPROF_LOCK(Well->prof, fast_sem_wait(Well->mx));
 }
 
-void unlock() {
-	uthread_sem_signal(Well->mx);
+LOCKPROF_WRAPPER void unlock() {
+	LOCKPROF_UNLOCK(Well->prof, fast_sem_signal(Well->mx));
 }
 
-void recordWaitingTime(int waitingTime) {
-	uthread_sem_wait(waitingHistogramMutex);
+LOCKPROF_WRAPPER void recordWaitingTime(int waitingTime) {
+	LOCKPROF_LOCK(waitingHistogramProf, fast_sem_wait(waitingHistogramMutex));
 	if (waitingTime < WAITING_HISTOGRAM_SIZE)
 		waitingHistogram[waitingTime] ++;
 	else
 		waitingHistogramOverflow++;
 	// update occupancyHistogram
 	occupancyHistogram[Well->endianness][Well->occupancy]++;
-	uthread_sem_signal(waitingHistogramMutex);
+	LOCKPROF_UNLOCK(waitingHistogramProf, fast_sem_signal(waitingHistogramMutex));
+}
+
+#ifdef VIRTUAL_TIME
+// LOCKED.  A signal nobody is blocked for yet is remembered by the semaphore
+// and lets the next waiter straight through, so it must not count as blocked.
+void will_wait(enum Endianness g) {
+	if (Well->tokens[g] > 0)
+		Well->tokens[g]--;
+	else {
+		Well->waiters[g]++;
+		vclock_block();
+	}
+}
+
+// LOCKED
+void count_wakeup(enum Endianness g) {
+	if (Well->waiters[g] > 0) {
+		Well->waiters[g]--;
+		vclock_wake(1);
+	}
+	else
+		Well->tokens[g]++;
+}
+#endif
+
+// LOCKED.  The queue of endianness g whose waiter goes next, or NULL if nobody is waiting.
+struct Queue* next_queue(enum Endianness g) {
+	struct Queue* first = NULL;
+	struct Queue* starving = NULL;
+	for (int p = 0; p < NUM_PRIORITIES; p++) {
+		struct Queue* q = &Well->queues[g][p];
+		if (q->length == 0)
+			continue;
+		if (first == NULL)
+			first = q;
+		int arrived = q->arrivals[q->head];
+		if (NUM_PRIORITIES > 1 && entryTicker - arrived >= STARVATION_BOUND
+			&& (starving == NULL || arrived < starving->arrivals[starving->head]))
+			starving = q;
+	}
+	return starving ? starving : first;
+}
+
+// LOCKED.  Let one more of endianness g in.  Releasing a queued waiter is a
+// wake-up; a post kept in spare is not.
+void post(enum Endianness g) {
+	struct Queue* q = next_queue(g);
+	if (q == NULL) {
+		Well->spare[g]++;
+		return;
+	}
+	q->head = (q->head + 1) % NUM_PEOPLE;
+	q->length--;
+	bench_wakeup(1);
+	fast_sem_signal(q->sem);
 }
 
 // LOCKED
 void signal() {
 	if (Well->endianness == BIG) {
 		Well->bigs_incoming++;
-		uthread_sem_signal(Well->big);
+		VCLOCK_WAKE(BIG);
+		TRACE_EVENT(TRACE_SEM_SIGNAL, BIG);
+		post(BIG);
 	}
 	else {
 		Well->littles_incoming++;
-		uthread_sem_signal(Well->little);
+		VCLOCK_WAKE(LITTLE);
+		TRACE_EVENT(TRACE_SEM_SIGNAL, LITTLE);
+		post(LITTLE);
 	}
 }
 
-void wait(enum Endianness g) {
-	if (g == BIG) {
-		uthread_sem_wait(Well->big);
-	}
-	else {
-		uthread_sem_wait(Well->little);
+// LOCKED, but unlocks while it waits for a post
+void wait(enum Endianness g, int priority, int initial_time) {
+	if (Well->spare[g] > 0) {
+		// traced as a wait that did not block, as before the queues
+		TRACE_EVENT(TRACE_SEM_WAIT_BEGIN, g);
+		Well->spare[g]--;
+		TRACE_EVENT(TRACE_SEM_WAIT_END, g);
+		return;
 	}
+	struct Queue* q = &Well->queues[g][priority];
+	q->arrivals[(q->head + q->length++) % NUM_PEOPLE] = initial_time;
+	unlock();
+	TRACE_EVENT(TRACE_SEM_WAIT_BEGIN, g);
+	fast_sem_wait(q->sem);
+	TRACE_EVENT(TRACE_SEM_WAIT_END, g);
+	lock();
 }
 
 void decrement_incoming_count(enum Endianness g) {
@@ -112,7 +272,7 @@ void decrement_incoming_count(enum Endianness g) {
 }
 
 // LOCKED
-void wait_to_drink(enum Endianness g) {
+void wait_to_drink(enum Endianness g, int priority, int initial_time) {
 	// If the well is fresh, then it's free to go in
 	if (Well->is_new) {
 		Well->is_new = 0;
@@ -124,9 +284,8 @@ void wait_to_drink(enum Endianness g) {
 		return;
 	}
 
-	unlock();
-	wait(g);
-	lock();
+	VCLOCK_BLOCK(g);
+	wait(g, priority, initial_time);
 	decrement_incoming_count(g);
 }
 
@@ -136,27 +295,42 @@ void drink(enum Endianness g) {
 	Well->endianness = g;
 }
 
-void enterWell(enum Endianness g) {
+void enterWell(enum Endianness g, int priority) {
+	long long start_ns = bench_now();
 	lock();
 	int initial_time = entryTicker;
-	wait_to_drink(g);
+#ifdef VIRTUAL_TIME
+	double start = vclock_time();
+#endif
+	wait_to_drink(g, priority, initial_time);
 	drink(g);
-	recordWaitingTime(entryTicker - initial_time);
+	TRACE_EVENT(TRACE_ENTER, g);
+	int waited = entryTicker - initial_time;
+	recordWaitingTime(waited);
+#ifdef VIRTUAL_TIME
+	waitingTimes[entryTicker] = vclock_time() - start;
+#endif
 	entryTicker++;
 	unlock();
+	bench_latency(bench_now() - start_ns);
+	bench_wait(&priorityWaits[priority], waited, bench_now() - start_ns);
 }
 
 void attempt_to_signal_bigs() {
 	while (Well->occupancy + Well->bigs_incoming < MAX_OCCUPANCY) {
 		Well->bigs_incoming++;
-		uthread_sem_signal(Well->big);
+		VCLOCK_WAKE(BIG);
+		TRACE_EVENT(TRACE_SEM_SIGNAL, BIG);
+		post(BIG);
 	}
 }
 
 void attempt_to_signal_littles() {
 	while (Well->occupancy + Well->littles_incoming < MAX_OCCUPANCY) {
 		Well->littles_incoming++;
-		uthread_sem_signal(Well->little);
+		VCLOCK_WAKE(LITTLE);
+		TRACE_EVENT(TRACE_SEM_SIGNAL, LITTLE);
+		post(LITTLE);
 	}
 }
 
@@ -223,6 +397,7 @@ void nonmax_fair_wait_policy() {
 
 void leaveWell() {
 	lock();
+	TRACE_EVENT(TRACE_LEAVE, Well->endianness);
 	Well->occupancy--;
 
 	// Fair count is either maxed or it's not
@@ -254,9 +429,20 @@ void decrement_drinker_count(enum Endianness g, int i) {
 	}
 }
 
-void drinker(enum Endianness g) {
+void drinker(enum Endianness g, int priority) {
+#ifdef VIRTUAL_TIME
+	struct VSleeper* s = vclock_sleeper_create(rand());
+	for (int i = 0; i < NUM_ITERATIONS; i++) {
+		enterWell(g, priority);
+		decrement_drinker_count(g, i);
+		vclock_sleep(s, dist_sample(s, SERVICE_DIST, SERVICE_TIME));
+		leaveWell();
+		vclock_sleep(s, dist_sample(s, THINK_DIST, THINK_TIME));
+	}
+	vclock_exit();
+#else
 	for (int i = 0; i < NUM_ITERATIONS; i++) {
-		enterWell(g);
+		enterWell(g, priority);
 		decrement_drinker_count(g, i);
 		for (int j = 0; j < NUM_PEOPLE; j++) {
 			uthread_yield();
@@ -266,25 +452,55 @@ void drinker(enum Endianness g) {
 			uthread_yield();
 		}
 	}
+#endif
 }
 
+// arg is the priority
 void* big_endian_drinker(void* arg) {
-	drinker(BIG);
+	drinker(BIG, (int) (intptr_t) arg);
 	return NULL;
 }
 
 void* little_endian_drinker(void* arg) {
-	drinker(LITTLE);
+	drinker(LITTLE, (int) (intptr_t) arg);
 	return NULL;
 }
 
 int main(int argc, char** argv) {
+	bench_init(argc, argv, params);
+	if (NUM_PRIORITIES < 1 || NUM_PRIORITIES > MAX_PRIORITIES) {
+		fprintf(stderr, "num_priorities must be 1 to %d\n", MAX_PRIORITIES);
+		return 1;
+	}
 	uthread_init(1);
 	Well = createWell();
 	uthread_t pt[NUM_PEOPLE];
-	waitingHistogramMutex = uthread_sem_create(1);
+	waitingHistogram = calloc(WAITING_HISTOGRAM_SIZE, sizeof(int));
+	occupancyHistogram[LITTLE] = calloc(MAX_OCCUPANCY + 1, sizeof(int));
+	occupancyHistogram[BIG] = calloc(MAX_OCCUPANCY + 1, sizeof(int));
+#ifdef VIRTUAL_TIME
+	waitingTimes = calloc(WAITING_HISTOGRAM_SIZE, sizeof(double));
+#endif
+	for (int p = 0; p < NUM_PRIORITIES; p++)
+		bench_waits_init(&priorityWaits[p], WAITING_HISTOGRAM_SIZE);
+	waitingHistogramMutex = fast_sem_create(1);
+#ifdef LOCK_PROFILE
+	waitingHistogramProf = lockprof_create("waitingHistogramMutex");
+#endif
 
-	srand(time(NULL));
+	srand(SEED ? SEED : time(NULL));
+#ifdef VIRTUAL_TIME
+	vclock_init(NUM_PEOPLE);
+#endif
+	bench_start(WAITING_HISTOGRAM_SIZE);
+	metrics_int("entries", &entryTicker);
+	metrics_int("bigs", &bigs);
+	metrics_int("littles", &littles);
+	metrics_ints("occupancy[big]", occupancyHistogram[BIG], MAX_OCCUPANCY + 1);
+	metrics_ints("occupancy[little]", occupancyHistogram[LITTLE], MAX_OCCUPANCY + 1);
+	metrics_int("waited overflow", &waitingHistogramOverflow);
+	metrics_ints("waited", waitingHistogram, WAITING_HISTOGRAM_SIZE < 16 ? WAITING_HISTOGRAM_SIZE : 16);
+	metrics_start(argv[0]);
 
 	// Start the threads, half big half little
 	for (int i = 0; i < NUM_PEOPLE; i++)
@@ -293,28 +509,41 @@ int main(int argc, char** argv) {
 		//printf("%d\n", random);
 		if (random % 2 == 0) {
 			bigs++;
-			pt[i] = uthread_create(big_endian_drinker, NULL);
+			pt[i] = uthread_create(big_endian_drinker, (void*) (intptr_t) (i % NUM_PRIORITIES));
 		}
 		else {
 			littles++;
-			pt[i] = uthread_create(little_endian_drinker, NULL);
+			pt[i] = uthread_create(little_endian_drinker, (void*) (intptr_t) (i % NUM_PRIORITIES));
 		}
 	}
 
 	for (int i = 0; i < NUM_PEOPLE; i++) {
 		uthread_join(pt[i], NULL);
 	}
+	bench_stop();
 
-	printf("Times with 1 little endian %d\n", occupancyHistogram[LITTLE][1]);
-	printf("Times with 2 little endian %d\n", occupancyHistogram[LITTLE][2]);
-	printf("Times with 3 little endian %d\n", occupancyHistogram[LITTLE][3]);
-	printf("Times with 1 big endian    %d\n", occupancyHistogram[BIG][1]);
-	printf("Times with 2 big endian    %d\n", occupancyHistogram[BIG][2]);
-	printf("Times with 3 big endian    %d\n", occupancyHistogram[BIG][3]);
+	for (int i = 1; i <= MAX_OCCUPANCY; i++)
+		printf("Times with %d little endian %d\n", i, occupancyHistogram[LITTLE][i]);
+	for (int i = 1; i <= MAX_OCCUPANCY; i++)
+		printf("Times with %d big endian    %d\n", i, occupancyHistogram[BIG][i]);
 	printf("Waiting Histogram\n");
 	for (int i = 0; i < WAITING_HISTOGRAM_SIZE; i++)
 		if (waitingHistogram[i])
 			printf("  Number of times people waited for %d %s to enter: %d\n", i, i == 1 ? "person" : "people", waitingHistogram[i]);
 	if (waitingHistogramOverflow)
 		printf("  Number of times people waited more than %d entries: %d\n", WAITING_HISTOGRAM_SIZE, waitingHistogramOverflow);
+	if (NUM_PRIORITIES > 1) {
+		char name[24];
+		for (int p = 0; p < NUM_PRIORITIES; p++) {
+			snprintf(name, sizeof(name), "Priority %d", p);
+			bench_print_waits(name, &priorityWaits[p]);
+		}
+	}
+#ifdef VIRTUAL_TIME
+	printf("Virtual time: %.3f, %.3f entries per unit (service %s %.3f, think %s %.3f)\n",
+		vclock_time(), entryTicker / vclock_time(),
+		dist_name[SERVICE_DIST], (double) SERVICE_TIME, dist_name[THINK_DIST], (double) THINK_TIME);
+	vclock_print_latency("Virtual waiting time", waitingTimes, entryTicker);
+#endif
+	bench_report(argv[0], entryTicker);
 }